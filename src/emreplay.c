@@ -0,0 +1,431 @@
+/*****************************************************
+ * Copyright Grégory Mounié 2018                     *
+ * This code is distributed under the GLPv3 licence. *
+ * Ce code est distribué sous la licence GPLv3+.     *
+ *****************************************************/
+
+/*
+ * emreplay [-g] <trace>
+ *
+ * Replays an allocation trace against emalloc, or against the C library with -g,
+ * and reports the throughput, the peak RSS and the latency percentiles.
+ *
+ * The trace is either a binary file written by emalloc_trace_start, or a memshell
+ * script of "alloc <size>" and "free <id>" lines, the ids numbering the allocations
+ * from 1 as memshell does. The whole trace is translated to slots before the replay,
+ * which only runs the allocator.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mem.h"
+
+typedef enum {
+    OP_MALLOC, OP_CALLOC, OP_ALIGNED_ALLOC, OP_REALLOC, OP_FREE
+} OP;
+
+/*
+ * An operation of the replay. The allocation gets the slot slot, a free or a
+ * realloc gives back the allocation of the slot previous, -1 for none.
+ */
+typedef struct {
+    OP op;
+    unsigned long size;
+    unsigned long alignment;
+    long slot;
+    long previous;
+} REPLAY_OP;
+
+typedef struct {
+    REPLAY_OP *ops;
+    unsigned long nb_ops;
+    unsigned long capacity;
+    unsigned long nb_slots;
+    /* operations on allocations made before the trace started */
+    unsigned long skipped;
+} REPLAY;
+
+static void add_op(REPLAY *replay, REPLAY_OP op) {
+    if (replay->nb_ops == replay->capacity) {
+        replay->capacity = replay->capacity ? 2 * replay->capacity : 1024;
+        replay->ops = realloc(replay->ops, replay->capacity * sizeof(REPLAY_OP));
+        if (replay->ops == NULL) {
+            perror("emreplay");
+            exit(EXIT_FAILURE);
+        }
+    }
+    replay->ops[replay->nb_ops++] = op;
+}
+
+/*
+ * Memshell script
+ */
+static void read_script(FILE *file, REPLAY *replay) {
+    char line[256];
+    unsigned long line_number = 0;
+
+    while (fgets(line, sizeof(line), file) != NULL) {
+        char command[16];
+        char argument[64];
+        char *end;
+        line_number++;
+        int nb_fields = sscanf(line, "%15s %63s", command, argument);
+        if (nb_fields <= 0 || command[0] == '#')
+            continue;
+        if (strcmp(command, "alloc") == 0 && nb_fields == 2) {
+            /* decimal or hexadecimal, as in memshell */
+            long size = strtol(argument, &end, 0);
+            if (*end == '\0' && size > 0) {
+                REPLAY_OP op = {OP_MALLOC, size, 0, replay->nb_slots++, -1};
+                add_op(replay, op);
+                continue;
+            }
+        } else if (strcmp(command, "free") == 0 && nb_fields == 2) {
+            long id = strtol(argument, &end, 10);
+            if (*end == '\0' && id > 0) {
+                if ((unsigned long) id > replay->nb_slots) {
+                    replay->skipped++;
+                    continue;
+                }
+                REPLAY_OP op = {OP_FREE, 0, 0, -1, id - 1};
+                add_op(replay, op);
+                continue;
+            }
+        } else if (strcmp(command, "exit") == 0) {
+            return;
+        } else if (strcmp(command, "init") == 0 || strcmp(command, "destroy") == 0 ||
+                   strcmp(command, "show") == 0 || strcmp(command, "used") == 0 ||
+                   strcmp(command, "help") == 0) {
+            continue;
+        }
+        fprintf(stderr, "emreplay: line %lu: incorrect command\n", line_number);
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*
+ * Binary trace
+ */
+
+/* Live addresses of the trace and their slots, open addressing */
+typedef struct {
+    uint64_t *addresses;
+    long *slots;
+    unsigned long mask;
+} ADDRESS_MAP;
+
+static unsigned long address_hash(ADDRESS_MAP *map, uint64_t address) {
+    return (address >> 4) * 0x9E3779B97F4A7C15UL >> 20 & map->mask;
+}
+
+static void address_map_set(ADDRESS_MAP *map, uint64_t address, long slot) {
+    unsigned long i = address_hash(map, address);
+    while (map->addresses[i] != 0 && map->addresses[i] != address)
+        i = (i + 1) & map->mask;
+    map->addresses[i] = address;
+    map->slots[i] = slot;
+}
+
+/* -1 if the address is not live, it is removed otherwise */
+static long address_map_take(ADDRESS_MAP *map, uint64_t address) {
+    unsigned long i = address_hash(map, address);
+    while (map->addresses[i] != address) {
+        if (map->addresses[i] == 0)
+            return -1;
+        i = (i + 1) & map->mask;
+    }
+    long slot = map->slots[i];
+    /* backward shift deletion: the next entries move up unless they are at home between i and j */
+    unsigned long j = i;
+    for (;;) {
+        j = (j + 1) & map->mask;
+        if (map->addresses[j] == 0)
+            break;
+        unsigned long k = address_hash(map, map->addresses[j]);
+        if ((i <= j) ? (i < k && k <= j) : (i < k || k <= j))
+            continue;
+        map->addresses[i] = map->addresses[j];
+        map->slots[i] = map->slots[j];
+        i = j;
+    }
+    map->addresses[i] = 0;
+    return slot;
+}
+
+static int compare_timestamps(const void *a, const void *b) {
+    const EmallocTraceEvent *ea = a, *eb = b;
+    return (ea->timestamp > eb->timestamp) - (ea->timestamp < eb->timestamp);
+}
+
+static void read_binary(FILE *file, REPLAY *replay) {
+    EmallocTraceHeader header;
+    if (fread(&header, sizeof(header), 1, file) != 1 || header.event_size != sizeof(EmallocTraceEvent)) {
+        fprintf(stderr, "emreplay: incorrect trace header\n");
+        exit(EXIT_FAILURE);
+    }
+    if (header.dropped != 0)
+        fprintf(stderr, "emreplay: warning: %u events were dropped while tracing, the replay is incomplete\n",
+                header.dropped);
+    unsigned long nb_events = 0, capacity = 1024;
+    EmallocTraceEvent *events = malloc(capacity * sizeof(EmallocTraceEvent));
+    while (events != NULL && fread(&events[nb_events], sizeof(EmallocTraceEvent), 1, file) == 1) {
+        if (++nb_events == capacity) {
+            capacity *= 2;
+            events = realloc(events, capacity * sizeof(EmallocTraceEvent));
+        }
+    }
+    if (events == NULL) {
+        perror("emreplay");
+        exit(EXIT_FAILURE);
+    }
+    /* The events of each thread are in order, the threads are interleaved by time. */
+    qsort(events, nb_events, sizeof(EmallocTraceEvent), compare_timestamps);
+
+    ADDRESS_MAP map;
+    map.mask = 1023;
+    while (map.mask < 2 * nb_events)
+        map.mask = 2 * map.mask + 1;
+    map.addresses = calloc(map.mask + 1, sizeof(uint64_t));
+    map.slots = calloc(map.mask + 1, sizeof(long));
+    if (map.addresses == NULL || map.slots == NULL) {
+        perror("emreplay");
+        exit(EXIT_FAILURE);
+    }
+    for (unsigned long i = 0; i < nb_events; i++) {
+        EmallocTraceEvent *e = &events[i];
+        REPLAY_OP op = {OP_MALLOC, e->size, 0, -1, -1};
+        switch (e->op) {
+            case EM_TRACE_MALLOC:
+            case EM_TRACE_CALLOC:
+                op.op = e->op == EM_TRACE_MALLOC ? OP_MALLOC : OP_CALLOC;
+                break;
+            case EM_TRACE_ALIGNED_ALLOC:
+                op.op = OP_ALIGNED_ALLOC;
+                op.alignment = e->previous;
+                break;
+            case EM_TRACE_REALLOC:
+                op.op = OP_REALLOC;
+                if (e->previous != 0) {
+                    op.previous = address_map_take(&map, e->previous);
+                    /* a realloc of an unknown block is an allocation */
+                    if (op.previous == -1)
+                        replay->skipped++;
+                }
+                break;
+            case EM_TRACE_FREE:
+                op.op = OP_FREE;
+                op.previous = address_map_take(&map, e->address);
+                if (op.previous == -1) {
+                    replay->skipped++;
+                    continue;
+                }
+                break;
+            default:
+                fprintf(stderr, "emreplay: incorrect event %lu\n", i);
+                exit(EXIT_FAILURE);
+        }
+        if (e->op != EM_TRACE_FREE) {
+            op.slot = replay->nb_slots++;
+            /* the allocator replayed may give a block where the traced one gave none */
+            if (e->address != 0)
+                address_map_set(&map, e->address, op.slot);
+        }
+        add_op(replay, op);
+    }
+    free(map.addresses);
+    free(map.slots);
+    free(events);
+}
+
+/*
+ * Replay
+ */
+
+typedef struct {
+    void *(*malloc)(size_t);
+    void *(*calloc)(size_t, size_t);
+    int (*posix_memalign)(void **, size_t, size_t);
+    void *(*realloc)(void *, size_t);
+    void (*free)(void *);
+} ALLOCATOR;
+
+static void *emalloc_std(size_t size) { return emalloc(size); }
+
+static void *ecalloc_std(size_t nmemb, size_t size) { return ecalloc(nmemb, size); }
+
+static int eposix_memalign_std(void **memptr, size_t alignment, size_t size) {
+    return eposix_memalign(memptr, alignment, size);
+}
+
+static void *erealloc_std(void *ptr, size_t size) { return erealloc(ptr, size); }
+
+static void efree_std(void *ptr) {
+    if (ptr != NULL)
+        efree(ptr);
+}
+
+static const ALLOCATOR emalloc_allocator = {emalloc_std, ecalloc_std, eposix_memalign_std, erealloc_std, efree_std};
+static const ALLOCATOR libc_allocator = {malloc, calloc, posix_memalign, realloc, free};
+
+static unsigned long long now_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/* Programs write their memory: a byte in each page makes it resident. */
+static void touch(void *ptr, unsigned long size) {
+    long page_size = sysconf(_SC_PAGESIZE);
+    for (unsigned long offset = 0; offset < size; offset += page_size)
+        ((char *) ptr)[offset] = 1;
+}
+
+static int compare_latencies(const void *a, const void *b) {
+    unsigned int la = *(const unsigned int *) a, lb = *(const unsigned int *) b;
+    return (la > lb) - (la < lb);
+}
+
+static long resident_kib() {
+    long pages = 0, resident = 0;
+    FILE *statm = fopen("/proc/self/statm", "r");
+    if (statm != NULL) {
+        if (fscanf(statm, "%ld %ld", &pages, &resident) != 2)
+            resident = 0;
+        fclose(statm);
+    }
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+/*
+ * The peak RSS of the process includes the reading of the trace. Writing 5 to
+ * clear_refs sets it back to the current RSS, false if the kernel refuses it.
+ */
+static bool reset_peak_resident() {
+    FILE *clear_refs = fopen("/proc/self/clear_refs", "w");
+    if (clear_refs == NULL)
+        return false;
+    bool reset = fputs("5", clear_refs) >= 0;
+    return fclose(clear_refs) == 0 && reset;
+}
+
+static long peak_resident_kib() {
+    char line[128];
+    long peak = 0;
+    FILE *status = fopen("/proc/self/status", "r");
+    if (status != NULL) {
+        while (fgets(line, sizeof(line), status) != NULL)
+            if (sscanf(line, "VmHWM: %ld kB", &peak) == 1)
+                break;
+        fclose(status);
+    }
+    return peak;
+}
+
+static void replay_trace(REPLAY *replay, const ALLOCATOR *allocator) {
+    void **slots = calloc(replay->nb_slots + 1, sizeof(void *));
+    unsigned int *latencies = malloc((replay->nb_ops + 1) * sizeof(unsigned int));
+    if (slots == NULL || latencies == NULL) {
+        perror("emreplay");
+        exit(EXIT_FAILURE);
+    }
+    bool peak_reset = reset_peak_resident();
+    long resident_before = resident_kib();
+    unsigned long long start = now_ns();
+
+    for (unsigned long i = 0; i < replay->nb_ops; i++) {
+        REPLAY_OP *op = &replay->ops[i];
+        void *previous = op->previous == -1 ? NULL : slots[op->previous];
+        void *result = NULL;
+        unsigned long long before = now_ns();
+        switch (op->op) {
+            case OP_MALLOC:
+                result = allocator->malloc(op->size);
+                break;
+            case OP_CALLOC:
+                result = allocator->calloc(1, op->size);
+                break;
+            case OP_ALIGNED_ALLOC:
+                if (allocator->posix_memalign(&result, op->alignment, op->size) != 0)
+                    result = NULL;
+                break;
+            case OP_REALLOC:
+                result = allocator->realloc(previous, op->size);
+                break;
+            case OP_FREE:
+                allocator->free(previous);
+                break;
+        }
+        latencies[i] = now_ns() - before;
+        if (op->previous != -1)
+            slots[op->previous] = NULL;
+        if (op->slot != -1) {
+            slots[op->slot] = result;
+            if (result != NULL && op->op != OP_REALLOC)
+                touch(result, op->size);
+        }
+    }
+
+    unsigned long long elapsed = now_ns() - start;
+    long peak = peak_resident_kib();
+    /* The blocks still live at the end of the trace are left as they are. */
+
+    qsort(latencies, replay->nb_ops, sizeof(unsigned int), compare_latencies);
+    unsigned long n = replay->nb_ops;
+    printf("ops                %lu\n", n);
+    printf("skipped            %lu\n", replay->skipped);
+    printf("ops/s              %.0f\n", elapsed ? n * 1e9 / elapsed : 0.0);
+    printf("peak RSS           %ld KiB (%ld KiB before the replay)\n", peak, resident_before);
+    if (!peak_reset)
+        printf("                   the peak could not be reset, it includes the reading of the trace\n");
+    if (n > 0) {
+        printf("latency ns         p50 %u  p90 %u  p99 %u  p99.9 %u  max %u\n",
+               latencies[n / 2], latencies[n * 9 / 10], latencies[n * 99 / 100],
+               latencies[n * 999 / 1000], latencies[n - 1]);
+    }
+}
+
+static void usage() {
+    fprintf(stderr, "usage: emreplay [-g] <trace>\n");
+    fprintf(stderr, "\t-g: replay against the C library allocator instead of emalloc\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+    const ALLOCATOR *allocator = &emalloc_allocator;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "g")) != -1) {
+        if (opt == 'g')
+            allocator = &libc_allocator;
+        else
+            usage();
+    }
+    if (optind != argc - 1)
+        usage();
+    FILE *file = fopen(argv[optind], "rb");
+    if (file == NULL) {
+        perror(argv[optind]);
+        return EXIT_FAILURE;
+    }
+
+    REPLAY replay = {};
+    unsigned long long magic = 0;
+    bool binary = fread(&magic, sizeof(magic), 1, file) == 1 && magic == EM_TRACE_MAGIC;
+    rewind(file);
+    if (binary)
+        read_binary(file, &replay);
+    else
+        read_script(file, &replay);
+    fclose(file);
+
+    printf("allocator          %s\n", allocator == &libc_allocator ? "libc" : "emalloc");
+    replay_trace(&replay, allocator);
+    free(replay.ops);
+    return EXIT_SUCCESS;
+}
@@ -10,36 +10,637 @@
 #include <assert.h>
 #include <sys/mman.h>
 #include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include "mem.h"
 #include "mem_internals.h"
 
 /** squelette du TP allocateur memoire */
 
-MemArena arena = {};
+MemArena arena = {.shared = true, .medium_engine = DEFAULT_MEDIUM_ENGINE};
 
-void *emalloc(unsigned long size) {
+MemOptions options = {
+        .threaded = DEFAULT_THREADED,
+        .check_level = DEFAULT_CHECK_LEVEL,
+        .trim_threshold = DEFAULT_TRIM_THRESHOLD,
+        .large_cache_max = DEFAULT_LARGE_CACHE_MAX,
+        .medium_engine = DEFAULT_MEDIUM_ENGINE,
+};
+
+// The counters are updated without locking, see MemCounters.
+static MemCounters *get_counters(MemArena *arena) {
+    return uses_tcache(arena) ? &tcache.counters : &arena->counters;
+}
+
+// n allocations of the same request and block size.
+static void count_allocs(MemArena *arena, MemKind kind, unsigned long requested, unsigned long block, unsigned long n) {
+    MemCounters *counters = get_counters(arena);
+    counters->nb_alloc[kind] += n;
+    counters->live_bytes += block * n;
+    counters->requested_bytes += requested * n;
+    counters->block_bytes += block * n;
+    if (kind == SMALL_KIND)
+        counters->small_live[block / SMALL_CLASS_STEP - 1] += n;
+}
+
+static void count_alloc(MemArena *arena, MemKind kind, unsigned long requested, unsigned long block) {
+    count_allocs(arena, kind, requested, block, 1);
+}
+
+static void count_frees(MemArena *arena, MemKind kind, unsigned long block, unsigned long n) {
+    MemCounters *counters = get_counters(arena);
+    counters->nb_free[kind] += n;
+    counters->live_bytes -= block * n;
+    if (kind == SMALL_KIND)
+        counters->small_live[block / SMALL_CLASS_STEP - 1] -= n;
+}
+
+static void count_free(MemArena *arena, MemKind kind, unsigned long block) {
+    count_frees(arena, kind, block, 1);
+}
+
+// A block resized in place counts as a new request for its new size.
+static void count_resize(MemArena *arena, unsigned long requested, unsigned long old_block, unsigned long block) {
+    MemCounters *counters = get_counters(arena);
+    counters->live_bytes += block - old_block;
+    counters->requested_bytes += requested;
+    counters->block_bytes += block;
+}
+
+static unsigned long get_medium_block_size(MemArena *arena, Alloc a) {
+    return medium_block_size(arena, a.size);
+}
+
+// The mark size goes from the header to the end of the footer, the lead of an
+// aligned allocation is before its header.
+static unsigned long get_usable_size(void *ptr, Alloc a) {
+    return (char *) a.ptr + a.size - 16 - (char *) ptr;
+}
+
+// Bytes of the block holding a live allocation, the size the counters know it by.
+static unsigned long get_block_size(MemArena *arena, void *ptr, MemKind *kind) {
+    if (is_small_chunk(arena, ptr)) {
+        *kind = SMALL_KIND;
+        return SMALL_CHUNKSIZE(get_slab(ptr)->size_class);
+    }
+    Alloc a = mark_check_and_get_alloc(ptr);
+    *kind = a.kind;
+    return a.kind == MEDIUM_KIND ? get_medium_block_size(arena, a) : get_large_segment_size(a);
+}
+
+static void count_alloc_of(MemArena *arena, void *ptr, unsigned long requested) {
+    MemKind kind;
+    unsigned long block = get_block_size(arena, ptr, &kind);
+    count_alloc(arena, kind, requested, block);
+}
+
+static void *alloc_untraced(MemArena *arena, unsigned long size) {
+    void *ptr;
     if (size <= 0)
         return NULL;
-    else if (size >= LARGEALLOC)
-        return emalloc_large(size);
-    else if (size <= SMALLALLOC)
-        return emalloc_small(size);
-    else return emalloc_medium(size);
+    else if (size >= LARGEALLOC) {
+        // NULL when the size does not fit in a mapping or the system has no memory left.
+        ptr = emalloc_large(arena, size);
+        if (ptr != NULL)
+            count_alloc_of(arena, ptr, size);
+    } else if (size <= SMALLALLOC) {
+        ptr = emalloc_small(arena, size);
+        count_alloc(arena, SMALL_KIND, size, SMALL_CHUNKSIZE(SMALL_CLASS(size)));
+    } else {
+        ptr = emalloc_medium(arena, size);
+        count_alloc(arena, MEDIUM_KIND, size, medium_block_size(arena, size + 32));
+    }
+    return ptr;
+}
+
+static void *calloc_untraced(MemArena *arena, unsigned long nmemb, unsigned long size) {
+    unsigned long total;
+    if (__builtin_mul_overflow(nmemb, size, &total))
+        return NULL;
+    if (total <= 0)
+        return NULL;
+    else if (total >= LARGEALLOC) {
+        void *ptr = ecalloc_large(arena, total);
+        if (ptr != NULL)
+            count_alloc_of(arena, ptr, total);
+        return ptr;
+    } else if (total <= SMALLALLOC) {
+        // Clearing a chunk costs less than tracking its zero state.
+        void *ptr = alloc_untraced(arena, total);
+        memset(ptr, 0, total);
+        return ptr;
+    } else {
+        void *ptr = ecalloc_medium(arena, total);
+        count_alloc(arena, MEDIUM_KIND, total, medium_block_size(arena, total + 32));
+        return ptr;
+    }
 }
 
-void efree(void *ptr) {
+static void *aligned_alloc_untraced(MemArena *arena, unsigned long alignment, unsigned long size) {
+    void *ptr;
+    if (size <= 0 || alignment == 0 || (alignment & (alignment - 1)) != 0)
+        return NULL;
+    // Every marked allocation is already aligned on 16 bytes.
+    else if (alignment <= 16)
+        return alloc_untraced(arena, size);
+    // Large segments are page aligned, a buddy block also holds the lead before the
+    // mark and at least a medium request.
+    else if (size >= LARGEALLOC || alignment > FIRST_ALLOC_MEDIUM ||
+             (arena->medium_engine == EM_MEDIUM_BUDDY &&
+              (size > SMALLALLOC ? size : SMALLALLOC + 1) + alignment - 16 >= LARGEALLOC))
+        ptr = ealigned_alloc_large(arena, size, alignment);
+    // The mark is right before the aligned address, inside a medium block.
+    else ptr = ealigned_alloc_medium(arena, size, alignment);
+    if (ptr != NULL)
+        count_alloc_of(arena, ptr, size);
+    return ptr;
+}
+
+int eposix_memalign(void **memptr, unsigned long alignment, unsigned long size) {
+    if (alignment == 0 || alignment % sizeof(void *) != 0 || (alignment & (alignment - 1)) != 0)
+        return EINVAL;
+    if (size == 0) {
+        *memptr = NULL;
+        return 0;
+    }
+    void *ptr = ealigned_alloc(alignment, size);
+    if (ptr == NULL)
+        return ENOMEM;
+    *memptr = ptr;
+    return 0;
+}
+
+static void free_untraced(MemArena *arena, void *ptr) {
+    // Small chunks have no mark, their slab is found from the address.
+    if (is_small_chunk(arena, ptr)) {
+        count_free(arena, SMALL_KIND, SMALL_CHUNKSIZE(get_slab(ptr)->size_class));
+        efree_small(arena, ptr);
+        return;
+    }
     Alloc a = mark_check_and_get_alloc(ptr);
     switch (a.kind) {
-        case SMALL_KIND:
-            efree_small(a);
+        case MEDIUM_KIND:
+            count_free(arena, MEDIUM_KIND, get_medium_block_size(arena, a));
+            efree_medium(arena, a);
+            break;
+        case LARGE_KIND:
+            count_free(arena, LARGE_KIND, get_large_segment_size(a));
+            efree_large(arena, a);
             break;
+        default:
+            assert(0);
+    }
+}
+
+// With EM_CHECK_SIZED the caller's size must match the allocation.
+static void check_size(MemArena *arena, void *ptr, unsigned long size) {
+    if (is_small_chunk(arena, ptr)) {
+        if (size > SMALLALLOC || get_slab(ptr)->size_class != SMALL_CLASS(size))
+            mark_corrupted(ptr, "size");
+        return;
+    }
+    Alloc a = mark_check_and_get_alloc(ptr);
+    if (size <= SMALLALLOC || (a.kind == MEDIUM_KIND && (size >= LARGEALLOC || a.size != size + 32)) ||
+        (a.kind == LARGE_KIND && (size < LARGEALLOC || a.size < size + 32)))
+        mark_corrupted(ptr, "size");
+}
+
+// The size of the caller gives the kind and the block, the mark is not read.
+static void free_sized_untraced(MemArena *arena, void *ptr, unsigned long size) {
+    if (options.check_sized)
+        check_size(arena, ptr, size);
+    if (size <= SMALLALLOC) {
+        unsigned int size_class = SMALL_CLASS(size);
+        count_free(arena, SMALL_KIND, SMALL_CHUNKSIZE(size_class));
+        efree_small_class(arena, ptr, size_class);
+    } else if (size < LARGEALLOC) {
+        Alloc a = {(char *) ptr - 16, MEDIUM_KIND, size + 32};
+        count_free(arena, MEDIUM_KIND, get_medium_block_size(arena, a));
+        efree_medium(arena, a);
+    } else {
+        // The segment may be larger than the request, its size is only in the mark.
+        free_untraced(arena, ptr);
+    }
+}
+
+unsigned long emalloc_usable_size(void *ptr) {
+    if (ptr == NULL)
+        return 0;
+    if (is_small_chunk(&arena, ptr))
+        return SMALL_CHUNKSIZE(get_slab(ptr)->size_class);
+    return get_usable_size(ptr, mark_check_and_get_alloc(ptr));
+}
+
+// The allocation is left as it is when the new one fails.
+static void *move_allocation(MemArena *arena, void *ptr, unsigned long old_size, unsigned long size) {
+    void *result = alloc_untraced(arena, size);
+    if (result == NULL)
+        return NULL;
+    memcpy(result, ptr, old_size < size ? old_size : size);
+    free_untraced(arena, ptr);
+    return result;
+}
+
+static void *realloc_untraced(MemArena *arena, void *ptr, unsigned long size) {
+    if (ptr == NULL)
+        return alloc_untraced(arena, size);
+    if (size == 0) {
+        free_untraced(arena, ptr);
+        return NULL;
+    }
+    // The chunk is kept when the size class does not change.
+    if (is_small_chunk(arena, ptr)) {
+        unsigned int size_class = get_slab(ptr)->size_class;
+        if (size <= SMALLALLOC && SMALL_CLASS(size) == size_class)
+            return ptr;
+        return move_allocation(arena, ptr, SMALL_CHUNKSIZE(size_class), size);
+    }
+    // The content of an aligned block is not at its start, it is moved to a new allocation.
+    Alloc a = mark_check_and_get_alloc(ptr);
+    if ((char *) a.ptr + 16 != ptr)
+        return move_allocation(arena, ptr, get_usable_size(ptr, a), size);
+    void *result = NULL;
+    // Try to keep the allocation where it is when the kind does not change.
+    switch (a.kind) {
         case MEDIUM_KIND:
-            efree_medium(a);
+            if (size > SMALLALLOC && size < LARGEALLOC)
+                result = erealloc_medium(arena, a, size);
             break;
         case LARGE_KIND:
-            efree_large(a);
+            if (size >= LARGEALLOC)
+                result = erealloc_large(arena, a, size);
             break;
         default:
             assert(0);
     }
+    if (result != NULL) {
+        MemKind kind;
+        unsigned long old_block = a.kind == MEDIUM_KIND ? get_medium_block_size(arena, a) : get_large_segment_size(a);
+        count_resize(arena, size, old_block, get_block_size(arena, result, &kind));
+        return result;
+    }
+    // Otherwise move the content to a new allocation.
+    return move_allocation(arena, ptr, get_usable_size(ptr, a), size);
+}
+
+static bool alloc_batch_untraced(MemArena *arena, unsigned long size, unsigned long n, void **ptrs) {
+    if (size >= LARGEALLOC) {
+        // Segments are mapped one by one anyway, a failure gives back the ones before.
+        for (unsigned long i = 0; i < n; i++) {
+            ptrs[i] = alloc_untraced(arena, size);
+            if (ptrs[i] == NULL) {
+                for (unsigned long j = 0; j < n; j++) {
+                    if (j < i)
+                        free_untraced(arena, ptrs[j]);
+                    ptrs[j] = NULL;
+                }
+                return false;
+            }
+        }
+    } else if (size <= SMALLALLOC) {
+        emalloc_small_batch(arena, size, n, ptrs);
+        count_allocs(arena, SMALL_KIND, size, SMALL_CHUNKSIZE(SMALL_CLASS(size)), n);
+    } else {
+        emalloc_medium_batch(arena, size, n, ptrs);
+        count_allocs(arena, MEDIUM_KIND, size, medium_block_size(arena, size + 32), n);
+    }
+    return true;
+}
+
+// Batch of medium blocks given back at once by efree_batch.
+#define FREE_BATCH_MEDIUM 64
+
+static void free_batch_untraced(MemArena *arena, void **ptrs, unsigned long n) {
+    // Small chunks first, in a single pass.
+    unsigned long nb_small[SMALL_CLASSES] = {};
+    efree_small_batch(arena, ptrs, n, nb_small);
+    for (unsigned int i = 0; i < SMALL_CLASSES; i++)
+        count_frees(arena, SMALL_KIND, SMALL_CHUNKSIZE(i), nb_small[i]);
+    // Medium blocks are gathered to be given back under one lock.
+    Alloc medium[FREE_BATCH_MEDIUM];
+    unsigned long nb_medium = 0;
+    for (unsigned long i = 0; i < n; i++) {
+        void *ptr = ptrs[i];
+        if (ptr == NULL || is_small_chunk(arena, ptr))
+            continue;
+        Alloc a = mark_check_and_get_alloc(ptr);
+        if (a.kind == LARGE_KIND) {
+            count_free(arena, LARGE_KIND, get_large_segment_size(a));
+            efree_large(arena, a);
+            continue;
+        }
+        count_free(arena, MEDIUM_KIND, get_medium_block_size(arena, a));
+        medium[nb_medium++] = a;
+        if (nb_medium == FREE_BATCH_MEDIUM) {
+            efree_medium_batch(arena, medium, nb_medium);
+            nb_medium = 0;
+        }
+    }
+    if (nb_medium > 0)
+        efree_medium_batch(arena, medium, nb_medium);
+}
+
+// Out of line, the traced functions stay as cheap as the untraced ones.
+__attribute__((cold, noinline))
+static void trace(unsigned char op, void *ptr, unsigned long size, void *previous) {
+    MemKind kind = EM_TRACE_NO_KIND;
+    if (ptr != NULL)
+        get_block_size(&arena, ptr, &kind);
+    trace_event(op, kind, size, ptr, previous);
+}
+
+// Tracing costs a single branch when it is off.
+void *emalloc(unsigned long size) {
+    void *ptr = alloc_untraced(&arena, size);
+    if (__builtin_expect(options.tracing, 0))
+        trace(EM_TRACE_MALLOC, ptr, size, NULL);
+    return ptr;
+}
+
+void *ecalloc(unsigned long nmemb, unsigned long size) {
+    void *ptr = calloc_untraced(&arena, nmemb, size);
+    if (__builtin_expect(options.tracing, 0))
+        trace(EM_TRACE_CALLOC, ptr, nmemb * size, NULL);
+    return ptr;
+}
+
+void *ealigned_alloc(unsigned long alignment, unsigned long size) {
+    void *ptr = aligned_alloc_untraced(&arena, alignment, size);
+    if (__builtin_expect(options.tracing, 0))
+        trace(EM_TRACE_ALIGNED_ALLOC, ptr, size, (void *) alignment);
+    return ptr;
+}
+
+void efree(void *ptr) {
+    // The kind is only known before the block is freed.
+    if (__builtin_expect(options.tracing, 0))
+        trace(EM_TRACE_FREE, ptr, 0, NULL);
+    free_untraced(&arena, ptr);
+}
+
+void *erealloc(void *ptr, unsigned long size) {
+    void *result = realloc_untraced(&arena, ptr, size);
+    if (__builtin_expect(options.tracing, 0))
+        trace(EM_TRACE_REALLOC, result, size, ptr);
+    return result;
+}
+
+void efree_sized(void *ptr, unsigned long size) {
+    if (__builtin_expect(options.tracing, 0))
+        trace(EM_TRACE_FREE, ptr, size, NULL);
+    free_sized_untraced(&arena, ptr, size);
+}
+
+unsigned long emalloc_batch(unsigned long size, unsigned long n, void **ptrs) {
+    if (size == 0) {
+        for (unsigned long i = 0; i < n; i++)
+            ptrs[i] = NULL;
+        return 0;
+    }
+    if (!alloc_batch_untraced(&arena, size, n, ptrs))
+        return 0;
+    if (__builtin_expect(options.tracing, 0))
+        for (unsigned long i = 0; i < n; i++)
+            trace(EM_TRACE_MALLOC, ptrs[i], size, NULL);
+    return n;
+}
+
+void efree_batch(void **ptrs, unsigned long n) {
+    if (__builtin_expect(options.tracing, 0))
+        for (unsigned long i = 0; i < n; i++)
+            if (ptrs[i] != NULL)
+                trace(EM_TRACE_FREE, ptrs[i], 0, NULL);
+    free_batch_untraced(&arena, ptrs, n);
+}
+
+int emallopt(int param, long value) {
+    switch (param) {
+        case EM_THREADED:
+            if (value != 0 && value != 1)
+                return 0;
+            // The caches of the calling thread are given back when leaving the threaded mode.
+            if (options.threaded && !value) {
+                for (unsigned int i = 0; i < SMALL_CLASSES; i++) {
+                    tcache_flush_small(i, 0);
+                }
+                arena_lock();
+                tcache_flush_medium();
+                arena_unlock();
+            }
+            options.threaded = value;
+            return 1;
+        case EM_TRIM_THRESHOLD:
+            if (value < 0)
+                return 0;
+            arena_lock();
+            options.trim_threshold = value;
+            mem_trim_medium(&arena);
+            arena_unlock();
+            return 1;
+        case EM_LARGE_CACHE_MAX:
+            if (value < 0)
+                return 0;
+            arena_lock();
+            options.large_cache_max = value;
+            mem_trim_large(&arena);
+            arena_unlock();
+            return 1;
+        case EM_HUGEPAGES:
+            if (value != 0 && value != 1)
+                return 0;
+            // Only the ranges mapped from now on are advised.
+            arena_lock();
+            options.hugepages = value;
+            arena_unlock();
+            return 1;
+        case EM_MEDIUM_ENGINE:
+            if (value != EM_MEDIUM_BUDDY && value != EM_MEDIUM_TLSF)
+                return 0;
+            // The blocks of the main arena must go back to the engine that gave them.
+            arena_lock();
+            options.medium_engine = value;
+            if (arena.medium_mapped_bytes == 0)
+                arena.medium_engine = value;
+            arena_unlock();
+            return 1;
+        case EM_CHECK_LEVEL:
+            if (value < EM_CHECK_OFF || value > EM_CHECK_FULL)
+                return 0;
+            options.check_level = value;
+            return 1;
+        case EM_CHECK_SIZED:
+            if (value != 0 && value != 1)
+                return 0;
+            options.check_sized = value;
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+// Address ranges of the main arena, copied under the lock to be compared out of it.
+typedef struct {
+    uint64_t start;
+    uint64_t end;
+} ArenaRange;
+
+// The small region, one superblock per order and the first TLSF pools.
+#define ARENA_RANGES (1 + TZL_SIZE + 16)
+
+// Copies up to capacity ranges, returns how many the arena has. The arena lock must be held.
+static unsigned long get_arena_ranges(ArenaRange *ranges, unsigned long capacity) {
+    unsigned long nb_ranges = 0;
+    uint64_t region = (uint64_t) arena.small_region;
+    if (region != 0 && nb_ranges++ < capacity)
+        ranges[nb_ranges - 1] = (ArenaRange) {region, region + arena.small_region_accessible};
+    for (uint64_t i = 0; i < TZL_SIZE; i++) {
+        uint64_t base = (uint64_t) arena.superblocks[i].base;
+        if (base != 0 && nb_ranges++ < capacity)
+            ranges[nb_ranges - 1] = (ArenaRange) {base, base + (1UL << i)};
+    }
+    for (TlsfPool *pool = arena.tlsf_pools; pool != NULL; pool = pool->next) {
+        if (nb_ranges++ < capacity)
+            ranges[nb_ranges - 1] = (ArenaRange) {(uint64_t) pool, (uint64_t) pool + pool->size};
+    }
+    return nb_ranges;
+}
+
+// Bytes of the huge pages that fit in the arena ranges between start and end.
+static unsigned long hugepage_capacity(ArenaRange *ranges, unsigned long nb_ranges, uint64_t start, uint64_t end) {
+    unsigned long capacity = 0;
+    for (unsigned long i = 0; i < nb_ranges; i++) {
+        uint64_t low = ranges[i].start > start ? ranges[i].start : start;
+        uint64_t high = ranges[i].end < end ? ranges[i].end : end;
+        low = (low + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+        high &= ~(HUGE_PAGE_SIZE - 1);
+        if (high > low)
+            capacity += high - low;
+    }
+    return capacity;
+}
+
+// Sums the huge pages of the mappings read from smaps, clamped to their arena ranges.
+static unsigned long count_hugepage_bytes(int fd, ArenaRange *ranges, unsigned long nb_ranges) {
+    // The kernel tells per mapping how much of it is backed by huge pages. The file
+    // is read without stdio, which could allocate.
+    char buffer[4096];
+    char line[256];
+    unsigned long line_length = 0;
+    unsigned long capacity = 0;
+    unsigned long bytes = 0;
+    ssize_t nb_read;
+    while ((nb_read = read(fd, buffer, sizeof(buffer))) > 0) {
+        for (ssize_t i = 0; i < nb_read; i++) {
+            if (buffer[i] != '\n') {
+                if (line_length < sizeof(line) - 1)
+                    line[line_length++] = buffer[i];
+                continue;
+            }
+            line[line_length] = '\0';
+            line_length = 0;
+            // A mapping starts with its address range, its fields follow.
+            if ((line[0] >= '0' && line[0] <= '9') || (line[0] >= 'a' && line[0] <= 'f')) {
+                char *end;
+                uint64_t start = strtoul(line, &end, 16);
+                capacity = hugepage_capacity(ranges, nb_ranges, start, strtoul(end + 1, NULL, 16));
+            } else if (capacity != 0 && strncmp(line, "AnonHugePages:", 14) == 0) {
+                // Neighbour mappings merge, the huge pages of the large segments or of
+                // the program in the same mapping are not told apart from the arena ones.
+                unsigned long huge = strtoul(line + 14, NULL, 10) * 1024;
+                bytes += huge < capacity ? huge : capacity;
+            }
+        }
+    }
+    return bytes;
+}
+
+unsigned long emalloc_hugepage_bytes(void) {
+    // The ranges are copied under the lock, the file is read and parsed out of it.
+    // Many TLSF pools need a larger array, mapped out of the lock too.
+    ArenaRange local_ranges[ARENA_RANGES];
+    ArenaRange *ranges = local_ranges;
+    unsigned long capacity_ranges = ARENA_RANGES;
+    arena_lock();
+    unsigned long nb_ranges = get_arena_ranges(ranges, capacity_ranges);
+    arena_unlock();
+    while (nb_ranges > capacity_ranges) {
+        if (ranges != local_ranges)
+            munmap(ranges, capacity_ranges * sizeof(ArenaRange));
+        capacity_ranges = 2 * nb_ranges;
+        ranges = mmap(0, capacity_ranges * sizeof(ArenaRange), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ranges == MAP_FAILED)
+            return 0;
+        arena_lock();
+        nb_ranges = get_arena_ranges(ranges, capacity_ranges);
+        arena_unlock();
+    }
+    unsigned long bytes = 0;
+    int fd = open("/proc/self/smaps", O_RDONLY);
+    if (fd != -1) {
+        bytes = count_hugepage_bytes(fd, ranges, nb_ranges);
+        close(fd);
+    }
+    if (ranges != local_ranges)
+        munmap(ranges, capacity_ranges * sizeof(ArenaRange));
+    return bytes;
+}
+
+static EmallocStats stats_of(MemArena *arena) {
+    EmallocStats stats = {};
+    // Taking the lock merges the counters of the calling thread.
+    mem_lock(arena);
+    for (unsigned int i = 0; i < 3; i++) {
+        stats.nb_alloc[i] = arena->counters.nb_alloc[i];
+        stats.nb_free[i] = arena->counters.nb_free[i];
+    }
+    stats.live_bytes = arena->counters.live_bytes;
+    stats.requested_bytes = arena->counters.requested_bytes;
+    stats.block_bytes = arena->counters.block_bytes;
+    for (unsigned int i = 0; i < SMALL_CLASSES; i++) {
+        stats.small_chunks[i] = arena->small_chunks[i];
+        stats.small_used[i] = arena->counters.small_live[i];
+    }
+    for (unsigned int i = 0; i < TZL_SIZE; i++) {
+        stats.free_blocks[i] = arena->nb_free_blocks[i];
+    }
+    stats.mapped_bytes = arena->small_region_accessible + arena->medium_mapped_bytes +
+                         __atomic_load_n(&arena->large_mapped_bytes, __ATOMIC_RELAXED);
+    mem_unlock(arena);
+    return stats;
+}
+
+EmallocStats emalloc_stats(void) {
+    return stats_of(&arena);
+}
+
+EArena *earena_create(void) {
+    // Out of every arena, zeroed like the main one.
+    MemArena *created = mmap(0, sizeof(MemArena), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (created == MAP_FAILED)
+        return NULL;
+    created->medium_engine = options.medium_engine;
+    return created;
+}
+
+void *earena_alloc(EArena *arena, unsigned long size) {
+    return alloc_untraced(arena, size);
+}
+
+void earena_free(EArena *arena, void *ptr) {
+    if (ptr != NULL)
+        free_untraced(arena, ptr);
+}
+
+void earena_destroy(EArena *arena) {
+    // Every mapping goes at once, the allocations are not visited.
+    mem_release_large(arena);
+    mem_release(arena);
+    if (munmap(arena, sizeof(MemArena)) == -1)
+        handle_fatalError("arena destroy");
+}
+
+EmallocStats earena_stats(EArena *arena) {
+    return stats_of(arena);
 }
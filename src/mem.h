@@ -15,10 +15,203 @@
 extern "C" {
 #endif
 
+/* NULL for a size of 0, or when the system has no memory left for a large allocation */
 void *emalloc(unsigned long size);
 
 void efree(void *ptr);
 
+/*
+ * Frees an allocation of emalloc, ecalloc (nmemb * size) or erealloc given the size
+ * last requested for it, without reading its mark. Allocations of ealigned_alloc and
+ * eposix_memalign must go to efree. The size is only checked with EM_CHECK_SIZED.
+ */
+void efree_sized(void *ptr, unsigned long size);
+
+/* Zeroed array of nmemb elements, NULL if the size overflows */
+void *ecalloc(unsigned long nmemb, unsigned long size);
+
+/* alignment must be a power of two, NULL otherwise */
+void *ealigned_alloc(unsigned long alignment, unsigned long size);
+
+/* alignment must be a power of two multiple of sizeof(void *), returns 0, EINVAL or ENOMEM */
+int eposix_memalign(void **memptr, unsigned long alignment, unsigned long size);
+
+/* Grows or shrinks in place when possible, moves the content otherwise */
+void *erealloc(void *ptr, unsigned long size);
+
+/*
+ * Batches of objects of the same size: small chunks are taken from their pool in one
+ * pass and medium blocks are carved from larger blocks. Returns n, or 0 with every
+ * pointer set to NULL when size is 0 or the system has no memory left.
+ */
+unsigned long emalloc_batch(unsigned long size, unsigned long n, void **ptrs);
+
+/* Frees n allocations of any size grouped by kind, NULL pointers are skipped */
+void efree_batch(void **ptrs, unsigned long n);
+
+/* Bytes usable from ptr, at least the requested size, 0 for NULL */
+unsigned long emalloc_usable_size(void *ptr);
+
+/* Parameters of emallopt */
+/* Threaded mode: per-thread caches in front of a locked shared arena */
+#define EM_THREADED 1
+/* Bytes of fully free medium superblocks kept resident before giving pages back to the system */
+#define EM_TRIM_THRESHOLD 2
+/* Bytes of freed large allocations kept mapped for reuse */
+#define EM_LARGE_CACHE_MAX 3
+/* Integrity checks done on free: EM_CHECK_OFF, EM_CHECK_CANARY or EM_CHECK_FULL */
+#define EM_CHECK_LEVEL 4
+/* Huge pages: small slabs and medium superblocks grow by 2 MiB aligned ranges advised for transparent huge pages */
+#define EM_HUGEPAGES 5
+/*
+ * Medium engine: EM_MEDIUM_BUDDY or EM_MEDIUM_TLSF, for the arenas created from now on
+ * and for the main arena as long as it has not mapped any medium block
+ */
+#define EM_MEDIUM_ENGINE 6
+/* efree_sized checks the size against the mark, which it reads then: 0 (default) or 1 */
+#define EM_CHECK_SIZED 7
+
+/* Values of EM_CHECK_LEVEL */
+/* No check, the header is only read for the kind and the size */
+#define EM_CHECK_OFF 0
+/* The header magic must match the address of the allocation */
+#define EM_CHECK_CANARY 1
+/* The footer must match the header too */
+#define EM_CHECK_FULL 2
+
+/* Values of EM_MEDIUM_ENGINE */
+/* Power of two blocks aligned on their size, cached per thread in threaded mode */
+#define EM_MEDIUM_BUDDY 0
+/* Blocks rounded to 16 bytes, found in 8 size classes per power of two, always locked */
+#define EM_MEDIUM_TLSF 1
+
+/* Returns 1 on success, 0 on an unknown parameter or an invalid value */
+int emallopt(int param, long value);
+
+/*
+ * Bytes of small slabs and medium superblocks currently backed by huge pages. An upper
+ * bound: the kernel counts them per mapping, and a mapping may hold other memory too.
+ */
+unsigned long emalloc_hugepage_bytes(void);
+
+/*
+ * Independent arenas: earena_destroy unmaps at once every slab, superblock and
+ * large segment of an arena, its allocations need not be freed one by one.
+ * An arena must only be used by one thread at a time, its allocations are not
+ * traced and can not be given to efree or erealloc.
+ */
+typedef struct _MemArena EArena;
+
+/* NULL when the system has no memory left */
+EArena *earena_create(void);
+
+void *earena_alloc(EArena *arena, unsigned long size);
+
+void earena_free(EArena *arena, void *ptr);
+
+void earena_destroy(EArena *arena);
+
+/*
+ * Regions: scratch memory without per-object header, allocated by bumping a
+ * pointer in chunks taken from emalloc. Objects are never freed one by one,
+ * eregion_release gives back at once everything allocated since a mark, and
+ * eregion_destroy everything. A region must only be used by one thread at a time.
+ */
+typedef struct _MemRegion ERegion;
+
+/* Position of a region, only valid until a release to an earlier mark */
+typedef struct {
+    void *chunk;
+    void *top;
+} ERegionMark;
+
+/* NULL when the system has no memory left */
+ERegion *eregion_create(void);
+
+/* Aligned on 16 bytes, NULL for a size of 0 */
+void *eregion_alloc(ERegion *region, unsigned long size);
+
+ERegionMark eregion_mark(ERegion *region);
+
+void eregion_release(ERegion *region, ERegionMark mark);
+
+void eregion_destroy(ERegion *region);
+
+/* Number of medium orders in EmallocStats, blocks of order i are 2**i bytes */
+#define EM_STATS_ORDERS 48
+
+/*
+ * Counters since the start of the program and state of the allocator.
+ * In threaded mode, the counters of other threads are only included up to the
+ * last time they took the arena lock, or up to their exit.
+ */
+typedef struct {
+    /* allocations and frees per kind: small, medium and large */
+    unsigned long nb_alloc[3];
+    unsigned long nb_free[3];
+    /* bytes mapped from the system, bytes of the blocks of live allocations */
+    unsigned long mapped_bytes;
+    unsigned long live_bytes;
+    /* free blocks of each order in the medium arena, thread caches excluded,
+       with the TLSF engine blocks of 2**i up to 2**(i+1) - 1 bytes */
+    unsigned long free_blocks[EM_STATS_ORDERS];
+    /* small chunks carved and chunks in use, for the 16, 32, 48 and 64 bytes classes */
+    unsigned long small_chunks[4];
+    unsigned long small_used[4];
+    /* internal fragmentation: bytes requested and bytes of the blocks given for them */
+    unsigned long requested_bytes;
+    unsigned long block_bytes;
+} EmallocStats;
+
+EmallocStats emalloc_stats(void);
+
+EmallocStats earena_stats(EArena *arena);
+
+/*
+ * Tracing: while it runs, every emalloc, ecalloc, ealigned_alloc, erealloc and
+ * efree appends an event to a buffer of its thread, a background thread writes
+ * them to the trace file. Events are dropped when a buffer is full.
+ * Returns 0, or -1 with errno set when the file can not be created.
+ */
+int emalloc_trace_start(const char *path);
+
+/* Writes the remaining events and the number dropped, then closes the trace file */
+void emalloc_trace_stop(void);
+
+/* Trace file: an EmallocTraceHeader, then EmallocTraceEvent records in time order for each thread */
+#define EM_TRACE_MAGIC 0x31454341525445ULL /* "ETRACE1" */
+
+typedef struct {
+    unsigned long long magic;
+    unsigned int event_size;
+    /* events lost because a thread buffer was full, written when the trace stops */
+    unsigned int dropped;
+} EmallocTraceHeader;
+
+/* Operations of the events */
+#define EM_TRACE_MALLOC 0
+#define EM_TRACE_CALLOC 1
+/* previous holds the alignment */
+#define EM_TRACE_ALIGNED_ALLOC 2
+/* address is the new allocation, previous the old one, either may be NULL */
+#define EM_TRACE_REALLOC 3
+#define EM_TRACE_FREE 4
+
+/* Kind of an event without allocation, small, medium and large are 0, 1 and 2 */
+#define EM_TRACE_NO_KIND 3
+
+typedef struct {
+    /* time stamp counter, or nanoseconds where there is none */
+    unsigned long long timestamp;
+    unsigned long long address;
+    unsigned long long previous;
+    unsigned long long size;
+    unsigned int thread;
+    unsigned char op;
+    unsigned char kind;
+    unsigned short reserved;
+} EmallocTraceEvent;
+
 #ifdef __cplusplus
 }
 #endif
@@ -10,11 +10,13 @@
 #include "mem.h"
 #include "mem_internals.h"
 
+// One step of Knuth's MMIX generator, modulo 2**64 for free, without a division.
 unsigned long knuth_mmix_one_round(unsigned long in) {
-    return in * 6364136223846793005UL % 1442695040888963407UL;
+    return in * 6364136223846793005UL + 1442695040888963407UL;
 }
 
-void *mark_memarea_and_get_user_ptr(void *ptr, unsigned long size, MemKind k) {
+// The size words hold the lead above MARK_LEAD_SHIFT.
+static void *write_mark(void *ptr, unsigned long size, unsigned long lead, MemKind k) {
     // Validation.
     assert(ptr != NULL);
     assert(k == SMALL_KIND || k == MEDIUM_KIND || k == LARGE_KIND);
@@ -22,77 +24,239 @@ void *mark_memarea_and_get_user_ptr(void *ptr, unsigned long size, MemKind k) {
     uint64_t magic_value = knuth_mmix_one_round((uint64_t) ptr);
     magic_value &= ~(0b11UL);
     magic_value += k;
+    uint64_t size_value = size | lead << MARK_LEAD_SHIFT;
     // Write memory area informations.
-    *((uint64_t *) ((uint64_t) ptr + 0 * sizeof(uint64_t))) = size;
+    *((uint64_t *) ((uint64_t) ptr + 0 * sizeof(uint64_t))) = size_value;
     *((uint64_t *) ((uint64_t) ptr + 1 * sizeof(uint64_t))) = magic_value;
     *((uint64_t *) ((uint64_t) ptr + size - 2 * sizeof(uint64_t))) = magic_value;
-    *((uint64_t *) ((uint64_t) ptr + size - 1 * sizeof(uint64_t))) = size;
+    *((uint64_t *) ((uint64_t) ptr + size - 1 * sizeof(uint64_t))) = size_value;
     return (void *) ((uint64_t) ptr) + 2 * sizeof(uint64_t);
 }
 
+void *mark_memarea_and_get_user_ptr(void *ptr, unsigned long size, MemKind k) {
+    return write_mark(ptr, size, 0, k);
+}
+
+void *mark_aligned_memarea_and_get_user_ptr(void *block, unsigned long lead, unsigned long size) {
+    // Validation.
+    assert(lead % 16 == 0);
+    assert(lead < 1UL << (64 - MARK_LEAD_SHIFT));
+    return write_mark((char *) block + lead, size, lead, MEDIUM_KIND);
+}
+
+void mark_corrupted(void *ptr, const char *what) {
+    fprintf(stderr, "emalloc: corrupted %s of %p\n", what, ptr);
+    abort();
+}
+
 Alloc mark_check_and_get_alloc(void *ptr) {
     // Validation.
     assert(ptr != NULL);
     // Find values.
     uint64_t magic_value_start = *((uint64_t *) ((uint64_t) ptr - 1 * sizeof(uint64_t)));
-    uint64_t size_start = *((uint64_t *) ((uint64_t) ptr - 2 * sizeof(uint64_t)));
-    uint64_t magic_value_end = *((uint64_t *) ((uint64_t) ptr + size_start - 4 * sizeof(uint64_t)));
-    uint64_t size_end = *((uint64_t *) ((uint64_t) ptr + size_start - 3 * sizeof(uint64_t)));
+    uint64_t size_value = *((uint64_t *) ((uint64_t) ptr - 2 * sizeof(uint64_t)));
+    uint64_t size_start = size_value & ((1UL << MARK_LEAD_SHIFT) - 1);
+    uint64_t lead = size_value >> MARK_LEAD_SHIFT;
     MemKind kind = (MemKind) (magic_value_start % 4);
-    // Data integrity verifications.
-    assert(kind == SMALL_KIND || kind == MEDIUM_KIND || kind == LARGE_KIND);
-    assert(magic_value_start == magic_value_end);
-    assert(size_start == size_end);
-    // Return allocation informations.
+    // Data integrity verifications, as much as the check level asks for.
+    if (options.check_level >= EM_CHECK_CANARY) {
+        uint64_t magic_value = knuth_mmix_one_round((uint64_t) ptr - 2 * sizeof(uint64_t));
+        if (kind == 3 || (magic_value_start & ~(0b11UL)) != (magic_value & ~(0b11UL)))
+            mark_corrupted(ptr, "header");
+    }
+    if (options.check_level >= EM_CHECK_FULL) {
+        uint64_t magic_value_end = *((uint64_t *) ((uint64_t) ptr + size_start - 4 * sizeof(uint64_t)));
+        uint64_t size_end = *((uint64_t *) ((uint64_t) ptr + size_start - 3 * sizeof(uint64_t)));
+        if (magic_value_start != magic_value_end || size_value != size_end)
+            mark_corrupted(ptr, "footer");
+    }
+    // Return allocation informations, an aligned block as if it was marked at its start.
     Alloc allocation = {};
     allocation.kind = kind;
-    allocation.ptr = (void *) ((uint64_t) ptr - 2 * sizeof(uint64_t));
-    allocation.size = size_start;
+    allocation.ptr = (void *) ((uint64_t) ptr - 2 * sizeof(uint64_t) - lead);
+    allocation.size = size_start + lead;
     return allocation;
 }
 
-unsigned long mem_realloc_small() {
-    assert(arena.chunkpool == 0);
-    unsigned long size = (FIRST_ALLOC_SMALL << arena.small_next_exponant);
-    arena.chunkpool = mmap(0,
-                           size,
-                           PROT_READ | PROT_WRITE | PROT_EXEC,
-                           MAP_PRIVATE | MAP_ANONYMOUS,
-                           -1,
-                           0);
-    if (arena.chunkpool == MAP_FAILED)
+// mem_realloc_small, mem_realloc_medium and mem_realloc_tlsf grow the shared arena, the arena lock must be held.
+static void reserve_small_region(MemArena *arena) {
+    // Only reserve the address space, slabs are made accessible when they are used.
+    char *region = mmap(0,
+                        SMALL_REGION_SIZE + HUGE_PAGE_SIZE,
+                        PROT_NONE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                        -1,
+                        0);
+    if (region == MAP_FAILED)
+        handle_fatalError("small region");
+    // Align the region on a huge page, and so the slabs on their size. The slack
+    // around it is given back, the region is then exactly what earena_destroy unmaps.
+    arena->small_region = (char *) (((uint64_t) region + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1));
+    unsigned long head = arena->small_region - region;
+    if (head != 0 && munmap(region, head) == -1)
+        handle_fatalError("small region");
+    if (munmap(arena->small_region + SMALL_REGION_SIZE, HUGE_PAGE_SIZE - head) == -1)
+        handle_fatalError("small region");
+}
+
+static void make_small_region_accessible(MemArena *arena, unsigned long end) {
+    // A huge page can only back a whole aligned range with the same protection.
+    if (options.hugepages) {
+        end = (end + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+    }
+    char *start = arena->small_region + arena->small_region_accessible;
+    unsigned long size = end - arena->small_region_accessible;
+    if (mprotect(start, size, PROT_READ | PROT_WRITE) != 0)
         handle_fatalError("small realloc");
-    arena.small_next_exponant++;
-    return size;
+    // Transparent huge pages may be disabled, the advice is only a hint.
+    if (options.hugepages) {
+        madvise(start, size, MADV_HUGEPAGE);
+    }
+    arena->small_region_accessible = end;
+}
+
+// The new run of slabs is given in slabs, the slabs are written when their chunks are carved.
+unsigned long mem_realloc_small(MemArena *arena, unsigned int size_class, char **slabs_out) {
+    assert(size_class < SMALL_CLASSES);
+    if (arena->small_region == NULL) {
+        reserve_small_region(arena);
+    }
+    unsigned long nb_slabs = 1UL << arena->small_next_exponant[size_class];
+    unsigned long size = nb_slabs * SLAB_SIZE;
+    if (arena->small_region_used + size > SMALL_REGION_SIZE)
+        handle_fatalError("small region exhausted");
+    char *slabs = arena->small_region + arena->small_region_used;
+    if (arena->small_region_used + size > arena->small_region_accessible) {
+        make_small_region_accessible(arena, arena->small_region_used + size);
+    }
+    *slabs_out = slabs;
+    // Published after the region is set, is_small_chunk reads it without the lock.
+    __atomic_store_n(&arena->small_region_used, arena->small_region_used + size, __ATOMIC_RELEASE);
+    // The runs stop doubling at one huge page.
+    if (arena->small_next_exponant[size_class] < SMALL_RUN_MAX_EXPOSANT) {
+        arena->small_next_exponant[size_class]++;
+    }
+    return nb_slabs;
 }
 
-unsigned long mem_realloc_medium() {
-    uint32_t indice = FIRST_ALLOC_MEDIUM_EXPOSANT + arena.medium_next_exponant;
-    assert(arena.TZL[indice] == 0);
-    unsigned long size = (FIRST_ALLOC_MEDIUM << arena.medium_next_exponant);
-    assert(size == (1 << indice));
-    arena.TZL[indice] = mmap(0,
-                             size * 2, // twice the size to allign
-                             PROT_READ | PROT_WRITE | PROT_EXEC,
-                             MAP_PRIVATE | MAP_ANONYMOUS,
-                             -1,
-                             0);
-    if (arena.TZL[indice] == MAP_FAILED)
+unsigned long mem_realloc_medium(MemArena *arena) {
+    // Smaller superblocks can not be backed by a huge page, they are skipped.
+    if (options.hugepages && FIRST_ALLOC_MEDIUM_EXPOSANT + arena->medium_next_exponant < HUGE_PAGE_EXPOSANT) {
+        arena->medium_next_exponant = HUGE_PAGE_EXPOSANT - FIRST_ALLOC_MEDIUM_EXPOSANT;
+    }
+    uint32_t indice = FIRST_ALLOC_MEDIUM_EXPOSANT + arena->medium_next_exponant;
+    assert(arena->TZL[indice] == 0);
+    unsigned long size = (FIRST_ALLOC_MEDIUM << arena->medium_next_exponant);
+    assert(size == (1UL << indice));
+    // Twice the size to align the superblock on its size for the buddy algorithm,
+    // the slack around it is given back.
+    char *mapping = mmap(0,
+                         size * 2,
+                         PROT_READ | PROT_WRITE | PROT_EXEC,
+                         MAP_PRIVATE | MAP_ANONYMOUS,
+                         -1,
+                         0);
+    if (mapping == MAP_FAILED)
+        handle_fatalError("medium realloc");
+    char *base = (char *) (((uint64_t) mapping + size - 1) & ~(size - 1));
+    unsigned long head = base - mapping;
+    if (head != 0 && munmap(mapping, head) == -1)
+        handle_fatalError("medium realloc");
+    if (munmap(base + size, size - head) == -1)
+        handle_fatalError("medium realloc");
+    arena->TZL[indice] = base;
+    if (options.hugepages) {
+        madvise(arena->TZL[indice], size, MADV_HUGEPAGE);
+    }
+    // The block maps live out of the superblock, fresh pages are already zeroed.
+    uint64_t *free_map = mmap(0,
+                              2 * SUPERBLOCK_MAP_BITS(indice) / 8,
+                              PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS,
+                              -1,
+                              0);
+    if (free_map == MAP_FAILED)
         handle_fatalError("medium realloc");
-    // align allocation to a multiple of the size
-    // for buddy algo
-    arena.TZL[indice] += (size - (((intptr_t) arena.TZL[indice]) % size));
-    arena.medium_next_exponant++;
-    return size; // lie on allocation size, but never free
+    // The whole superblock is the single free block of its order, its links are zeroed too.
+    uint64_t *zero_map = free_map + SUPERBLOCK_MAP_BITS(indice) / 64;
+    free_map[0] = 1;
+    zero_map[0] = 1;
+    arena->TZL_map |= 1UL << indice;
+    arena->nb_free_blocks[indice] = 1;
+    arena->superblocks[indice].base = arena->TZL[indice];
+    arena->superblocks[indice].free_map = free_map;
+    arena->superblocks[indice].zero_map = zero_map;
+    arena->medium_mapped_bytes += size + 2 * SUPERBLOCK_MAP_BITS(indice) / 8;
+    arena->medium_next_exponant++;
+    return size;
+}
+
+// A new pool holds a single free block, returned to be inserted by the TLSF engine.
+TlsfBlock *mem_realloc_tlsf(MemArena *arena) {
+    // Smaller pools can not be backed by a huge page, they are skipped.
+    if (options.hugepages && TLSF_POOL_MIN_EXPOSANT + arena->tlsf_next_exponant < HUGE_PAGE_EXPOSANT) {
+        arena->tlsf_next_exponant = HUGE_PAGE_EXPOSANT - TLSF_POOL_MIN_EXPOSANT;
+    }
+    unsigned long size = 1UL << (TLSF_POOL_MIN_EXPOSANT + arena->tlsf_next_exponant);
+    // With huge pages the pool is aligned on them, the slack around it is given back.
+    unsigned long slack = options.hugepages ? HUGE_PAGE_SIZE : 0;
+    char *mapping = mmap(0,
+                         size + slack,
+                         PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS,
+                         -1,
+                         0);
+    if (mapping == MAP_FAILED)
+        handle_fatalError("tlsf realloc");
+    TlsfPool *pool = (TlsfPool *) mapping;
+    if (options.hugepages) {
+        pool = (TlsfPool *) (((uint64_t) mapping + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1));
+        unsigned long head = (char *) pool - mapping;
+        if (head != 0 && munmap(mapping, head) == -1)
+            handle_fatalError("tlsf realloc");
+        if (munmap((char *) pool + size, slack - head) == -1)
+            handle_fatalError("tlsf realloc");
+        madvise(pool, size, MADV_HUGEPAGE);
+    }
+    pool->next = arena->tlsf_pools;
+    pool->size = size;
+    arena->tlsf_pools = pool;
+    // The sentinel is a used block of no size, merges stop on it.
+    TlsfBlock *block = (TlsfBlock *) (pool + 1);
+    TlsfBlock *sentinel = (TlsfBlock *) ((char *) pool + size - TLSF_HEADER);
+    block->prev_phys = NULL;
+    block->size = (char *) sentinel - (char *) block;
+    sentinel->prev_phys = block;
+    sentinel->size = 0;
+    arena->medium_mapped_bytes += size;
+    if (TLSF_POOL_MIN_EXPOSANT + arena->tlsf_next_exponant < TLSF_POOL_MAX_EXPOSANT) {
+        arena->tlsf_next_exponant++;
+    }
+    return block;
 }
 
 // used for test in buddy algo
 unsigned int nb_TZL_entries() {
-    int nb = 0;
-
-    for (int i = 0; i < TZL_SIZE; i++)
-        if (arena.TZL[i])
-            nb++;
+    return __builtin_popcountl(arena.TZL_map);
+}
 
-    return nb;
+// Unmap the small region, the superblocks with their maps and the TLSF pools, whatever they hold.
+void mem_release(MemArena *arena) {
+    if (arena->small_region != NULL && munmap(arena->small_region, SMALL_REGION_SIZE) == -1)
+        handle_fatalError("arena release");
+    for (uint64_t i = 0; i < TZL_SIZE; i++) {
+        MemSuperblock *superblock = &arena->superblocks[i];
+        if (superblock->base == NULL)
+            continue;
+        if (munmap(superblock->base, 1UL << i) == -1 ||
+            munmap(superblock->free_map, 2 * SUPERBLOCK_MAP_BITS(i) / 8) == -1)
+            handle_fatalError("arena release");
+    }
+    TlsfPool *pool = arena->tlsf_pools;
+    while (pool != NULL) {
+        TlsfPool *next = pool->next;
+        if (munmap(pool, pool->size) == -1)
+            handle_fatalError("arena release");
+        pool = next;
+    }
 }
@@ -13,6 +13,9 @@ extern "C" {
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
 
 #define handle_fatalError(msg)                        \
     do { char c[1048] = {}; snprintf(c, 1048, "%s %s %d",msg,           \
@@ -20,13 +23,34 @@ extern "C" {
     perror(c); exit(EXIT_FAILURE); } while(0)
 
 #define SMALLALLOC 64
-// SMALLALLOC + 2 MAGIC + 2 Tailles sur 8o == 96o 
-#define CHUNKSIZE 96
+// Small requests are rounded to 16, 32, 48 or 64 bytes, each class has its own chunk pool.
+#define SMALL_CLASS_STEP 16
+#define SMALL_CLASSES (SMALLALLOC / SMALL_CLASS_STEP)
+#define SMALL_CLASS(size) (((size) - 1) / SMALL_CLASS_STEP)
+// Small chunks carry no mark, the usable size is the whole chunk.
+#define SMALL_CHUNKSIZE(class) (((class) + 1) * SMALL_CLASS_STEP)
 // 128 Kio == 128 * 1024 == 2**17 == (1<<17)
 #define LARGEALLOC (1<<17)
 
-// 2**13o == 16Kio
-#define FIRST_ALLOC_SMALL (CHUNKSIZE <<7) // 96o * 128
+// Small chunks live in slabs of 2**SLAB_EXPOSANT bytes aligned on their size.
+// The slab header gives the kind and the size class of all its chunks, it is found
+// by masking a chunk address. Slabs are carved from one reserved region, so a
+// pointer is known to be small by a range check.
+#define SLAB_EXPOSANT 14
+#define SLAB_SIZE (1UL << SLAB_EXPOSANT)
+// the header keeps the first chunk on a cache line boundary
+#define SLAB_HEADER 64
+#define SLAB_MAGIC (0x51ab51ab51ab51a8UL | SMALL_KIND)
+// 32 Gio of address space, only the slabs in use are accessible
+#define SMALL_REGION_EXPOSANT 35
+#define SMALL_REGION_SIZE (1UL << SMALL_REGION_EXPOSANT)
+// a class grows by runs of slabs doubling up to 2**SMALL_RUN_MAX_EXPOSANT slabs, one huge page
+#define SMALL_RUN_MAX_EXPOSANT (HUGE_PAGE_EXPOSANT - SLAB_EXPOSANT)
+
+// In huge page mode, the small region is made accessible by whole huge pages and
+// medium superblocks are at least one huge page.
+#define HUGE_PAGE_EXPOSANT 21
+#define HUGE_PAGE_SIZE (1UL << HUGE_PAGE_EXPOSANT)
 #define FIRST_ALLOC_MEDIUM_EXPOSANT 17
 #define FIRST_ALLOC_MEDIUM (1<<FIRST_ALLOC_MEDIUM_EXPOSANT)
 
@@ -35,15 +59,210 @@ typedef enum _MemKind {
     SMALL_KIND, MEDIUM_KIND, LARGE_KIND
 } MemKind;
 
+// The size words of a mark hold above this bit the bytes from the start of the
+// medium block to the mark, not 0 for an aligned allocation only.
+#define MARK_LEAD_SHIFT 48
+
 #define TZL_SIZE 48
+// Smallest medium block: 2**7o == 128o
+#define MEDIUM_MIN_EXPOSANT 7
+
+// A superblock of order K keeps one bit per block for each order from K down to
+// MEDIUM_MIN_EXPOSANT, set while the block is free in a TZL list.
+// The bits of order i start at bit 2**(K-i) - 1, as in a binary heap.
+// A second map with the same layout tells which free blocks are still zeroed.
+#define SUPERBLOCK_MAP_BITS(order) (2UL << ((order) - MEDIUM_MIN_EXPOSANT))
+
+// Fully free superblocks are kept resident up to the trim threshold, the oldest
+// ones beyond it give their pages back to the system.
+#define DEFAULT_TRIM_THRESHOLD (1UL << 22)
+
+typedef struct _MemSuperblock {
+    void *base;
+    uint64_t *free_map;
+    uint64_t *zero_map;
+    // when the superblock became fully free, 0 while it is used or released
+    unsigned long empty_since;
+} MemSuperblock;
+
+/*
+ * TLSF medium engine, see mem_tlsf.c. Free blocks are kept in lists of
+ * 2**TLSF_SL_LOG2 sub-classes per power of two, blocks are TLSF_HEADER bytes
+ * longer than their mark and rounded to 16 bytes.
+ */
+#define TLSF_SL_LOG2 3
+#define TLSF_SL_COUNT (1 << TLSF_SL_LOG2)
+#define TLSF_FL_COUNT 32
+#define TLSF_HEADER 16
+// a smaller tail is left in the block it is split from
+#define TLSF_MIN_BLOCK 64
+#define TLSF_BLOCK_SIZE(real_size) (((real_size) + TLSF_HEADER + 15) & ~15UL)
+// pools double from 2**TLSF_POOL_MIN_EXPOSANT bytes up to 2**TLSF_POOL_MAX_EXPOSANT
+#define TLSF_POOL_MIN_EXPOSANT 18
+#define TLSF_POOL_MAX_EXPOSANT 25
+
+typedef struct _TlsfBlock {
+    // physically previous block, NULL for the first block of a pool
+    struct _TlsfBlock *prev_phys;
+    // bytes up to the next header, the lowest bit is set while the block is free
+    unsigned long size;
+    // only in free blocks, where the mark is otherwise
+    struct _TlsfBlock *next_free;
+    struct _TlsfBlock *prev_free;
+} TlsfBlock;
+
+// A pool starts with this header, its blocks follow up to an empty sentinel block.
+typedef struct _TlsfPool {
+    struct _TlsfPool *next;
+    unsigned long size;
+} TlsfPool;
+
+typedef struct _MemSlab {
+    uint64_t magic;
+    unsigned int size_class;
+} MemSlab;
+
+// Freed large segments are cached in bins of power of two page counts, up to
+// DEFAULT_LARGE_CACHE_MAX bytes, the least recently freed are unmapped first.
+#define LARGE_BINS 48
+#define DEFAULT_LARGE_CACHE_MAX (1UL << 25)
+// A cached segment is reused for requests down to half its size, the next bins
+// are searched when the bin of the request has none.
+#define LARGE_REUSE_MAX_FACTOR 2
+
+typedef struct _LargeSegment {
+    struct _LargeSegment *bin_next;
+    struct _LargeSegment *bin_prev;
+    struct _LargeSegment *lru_next;
+    struct _LargeSegment *lru_prev;
+    unsigned long size;
+} LargeSegment;
+
+// Large segments of the arenas of earena_create start with these links, their mark follows.
+typedef struct _LargeLink {
+    struct _LargeLink *next;
+    struct _LargeLink *prev;
+} LargeLink;
+
+// Always on counters, kept by the arena in single threaded mode and by each thread
+// cache in threaded mode, merged into the arena when the thread takes the lock.
+typedef struct _MemCounters {
+    unsigned long nb_alloc[3];
+    unsigned long nb_free[3];
+    // a thread freeing the blocks of another one goes below zero
+    long live_bytes;
+    long small_live[SMALL_CLASSES];
+    unsigned long requested_bytes;
+    unsigned long block_bytes;
+} MemCounters;
 
 typedef struct _MemArena {
-    void *chunkpool;
+    // Treiber stacks of free chunks, see mem_small.c
+    uint64_t chunkpool[SMALL_CLASSES];
     void *TZL[TZL_SIZE];
-    int small_next_exponant;
+    // bit i is set when TZL[i] is not empty, TZL_SIZE fits in 64 bits
+    uint64_t TZL_map;
+    MemSuperblock superblocks[TZL_SIZE];
+    // bytes of fully free superblocks still resident
+    unsigned long empty_bytes;
+    unsigned long empty_clock;
+    LargeSegment *large_bins[LARGE_BINS];
+    // least and most recently cached large segments
+    LargeSegment *large_oldest;
+    LargeSegment *large_newest;
+    unsigned long large_cached_bytes;
+    // reserved small region and its bytes already given to slabs, see is_small_chunk
+    char *small_region;
+    unsigned long small_region_used;
+    unsigned long small_region_accessible;
+    int small_next_exponant[SMALL_CLASSES];
+    // part of the last run of each class not carved into chunks yet, see mem_small.c
+    char *small_tail[SMALL_CLASSES];
+    char *small_tail_end[SMALL_CLASSES];
     int medium_next_exponant;
+    MemCounters counters;
+    unsigned long nb_free_blocks[TZL_SIZE];
+    unsigned long small_chunks[SMALL_CLASSES];
+    // superblocks with their maps, and large segments, updated atomically
+    unsigned long medium_mapped_bytes;
+    unsigned long large_mapped_bytes;
+    // the main arena, shared by the threads, the others are created by earena_create
+    bool shared;
+    // live large segments of the other arenas, for earena_destroy
+    LargeLink *large_live;
+    // EM_MEDIUM_BUDDY or EM_MEDIUM_TLSF, fixed once the arena has medium blocks
+    int medium_engine;
+    // bit i of tlsf_fl_map is set when tlsf_sl_map[i] is not 0, and bit j of
+    // tlsf_sl_map[i] when tlsf_free[i][j] is not empty
+    uint64_t tlsf_fl_map;
+    uint32_t tlsf_sl_map[TLSF_FL_COUNT];
+    TlsfBlock *tlsf_free[TLSF_FL_COUNT][TLSF_SL_COUNT];
+    TlsfPool *tlsf_pools;
+    int tlsf_next_exponant;
 } MemArena;
 
+// Regions bump allocate in chunks of one medium block, larger objects get a chunk of their own.
+#define REGION_CHUNK_SIZE (1UL << 16)
+
+// Head of a region chunk, its objects follow up to end.
+typedef struct _RegionChunk {
+    struct _RegionChunk *prev;
+    char *end;
+} RegionChunk;
+
+// A region lives in its first chunk, which is only given back by eregion_destroy.
+typedef struct _MemRegion {
+    RegionChunk *chunk;
+    char *top;
+    char *end;
+    // last chunk given up by a release, kept for the next one
+    RegionChunk *spare;
+} MemRegion;
+
+// Threaded mode: small chunks and medium blocks up to 2**TCACHE_MAX_ORDER are recycled
+// by per-thread caches without locking, the shared arena is only locked to refill or flush them.
+#define TCACHE_SMALL_MAX 256
+#define TCACHE_MAX_ORDER 15
+// Bytes a thread may keep cached for each medium order.
+#define TCACHE_MEDIUM_BYTES (1<<16)
+
+// Set by the build, EM_CHECK_FULL otherwise.
+#ifndef DEFAULT_CHECK_LEVEL
+#define DEFAULT_CHECK_LEVEL 2
+#endif
+
+// The preloaded library starts in threaded mode, programs may create threads at any time.
+#ifndef DEFAULT_THREADED
+#define DEFAULT_THREADED 0
+#endif
+
+// Set by the build, EM_MEDIUM_BUDDY otherwise.
+#ifndef DEFAULT_MEDIUM_ENGINE
+#define DEFAULT_MEDIUM_ENGINE 0
+#endif
+
+typedef struct _MemOptions {
+    bool threaded;
+    int check_level;
+    // efree_sized reads the mark to check the size
+    bool check_sized;
+    unsigned long trim_threshold;
+    unsigned long large_cache_max;
+    bool hugepages;
+    bool tracing;
+    // engine of the arenas created from now on
+    int medium_engine;
+} MemOptions;
+
+typedef struct _ThreadCache {
+    void *chunkpool[SMALL_CLASSES];
+    unsigned int nb_chunks[SMALL_CLASSES];
+    void *TZL[TCACHE_MAX_ORDER + 1];
+    unsigned int nb_TZL[TCACHE_MAX_ORDER + 1];
+    MemCounters counters;
+    bool registered;
+} ThreadCache;
+
 typedef struct _Alloc {
     void *ptr;
     MemKind kind;
@@ -52,29 +271,124 @@ typedef struct _Alloc {
 
 extern MemArena arena;
 
+extern MemOptions options;
+
+extern __thread ThreadCache tcache;
+
+// No memory is read, the region is empty until the first small allocation.
+// Called without the lock: the acquire load pairs with the store of mem_realloc_small,
+// a region used is already set.
+static inline bool is_small_chunk(MemArena *arena, void *ptr) {
+    unsigned long used = __atomic_load_n(&arena->small_region_used, __ATOMIC_ACQUIRE);
+    return (uint64_t) ptr - (uint64_t) arena->small_region < used;
+}
+
+// The thread caches only front the main arena.
+static inline bool uses_tcache(MemArena *arena) {
+    return options.threaded && arena->shared;
+}
+
+// Bytes of the block holding a medium allocation of real_size bytes with its mark.
+static inline unsigned long medium_block_size(MemArena *arena, unsigned long real_size) {
+    if (arena->medium_engine == EM_MEDIUM_TLSF)
+        return TLSF_BLOCK_SIZE(real_size);
+    return 1UL << (64 - __builtin_clzl(real_size - 1));
+}
+
+static inline MemSlab *get_slab(void *ptr) {
+    return (MemSlab *) ((uint64_t) ptr & ~(SLAB_SIZE - 1));
+}
+
+void arena_lock();
+
+void arena_unlock();
+
+void mem_lock(MemArena *arena);
+
+void mem_unlock(MemArena *arena);
+
+void tcache_register();
+
+void tcache_merge_counters();
+
+void trace_event(unsigned char op, MemKind kind, unsigned long size, void *address, void *previous);
+
+void tcache_flush_small(unsigned int size_class, unsigned int keep);
+
+bool tcache_flush_medium();
+
 unsigned long knuth_mmix_one_round(unsigned long in);
 
 void *mark_memarea_and_get_user_ptr(void *ptr, unsigned long size, MemKind k);
 
+// Marks size bytes lead bytes into a medium block, its allocation is the whole block.
+void *mark_aligned_memarea_and_get_user_ptr(void *block, unsigned long lead, unsigned long size);
+
 Alloc mark_check_and_get_alloc(void *ptr);
 
+void mark_corrupted(void *ptr, const char *what);
+
 unsigned int nb_TZL_entries();
 
-unsigned long mem_realloc_small();
+unsigned int puiss2(unsigned long size);
+
+unsigned long mem_realloc_small(MemArena *arena, unsigned int size_class, char **slabs);
+
+unsigned long mem_realloc_medium(MemArena *arena);
+
+void mem_trim_medium(MemArena *arena);
+
+void mem_trim_large(MemArena *arena);
+
+TlsfBlock *mem_realloc_tlsf(MemArena *arena);
+
+void mem_release(MemArena *arena);
+
+void mem_release_large(MemArena *arena);
+
+void *emalloc_small(MemArena *arena, unsigned long size);
+
+void *emalloc_medium(MemArena *arena, unsigned long size);
+
+void *emalloc_large(MemArena *arena, unsigned long size);
+
+void efree_small(MemArena *arena, void *ptr);
+
+void efree_small_class(MemArena *arena, void *ptr, unsigned int size_class);
+
+void emalloc_small_batch(MemArena *arena, unsigned long size, unsigned long n, void **ptrs);
+
+void efree_small_batch(MemArena *arena, void **ptrs, unsigned long n, unsigned long *nb_freed);
+
+void emalloc_medium_batch(MemArena *arena, unsigned long size, unsigned long n, void **ptrs);
+
+void efree_medium_batch(MemArena *arena, Alloc *allocs, unsigned long n);
+
+void efree_medium(MemArena *arena, Alloc a);
+
+void efree_large(MemArena *arena, Alloc a);
+
+unsigned long get_large_segment_size(Alloc a);
+
+void *erealloc_medium(MemArena *arena, Alloc a, unsigned long size);
+
+void *ecalloc_medium(MemArena *arena, unsigned long size);
+
+void *ecalloc_large(MemArena *arena, unsigned long size);
 
-unsigned long mem_realloc_medium();
+void *ealigned_alloc_medium(MemArena *arena, unsigned long size, unsigned long alignment);
 
-void *emalloc_small(unsigned long size);
+void *ealigned_alloc_large(MemArena *arena, unsigned long size, unsigned long alignment);
 
-void *emalloc_medium(unsigned long size);
+void *erealloc_large(MemArena *arena, Alloc a, unsigned long size);
 
-void *emalloc_large(unsigned long size);
+void *tlsf_alloc(MemArena *arena, unsigned long real_size);
 
-void efree_small(Alloc a);
+void *tlsf_alloc_aligned(MemArena *arena, unsigned long real_size, unsigned long alignment);
 
-void efree_medium(Alloc a);
+void tlsf_free(MemArena *arena, void *ptr);
 
-void efree_large(Alloc a);
+bool tlsf_resize(MemArena *arena, void *ptr, unsigned long real_size);
 
 #ifdef __cplusplus
 }
@@ -4,12 +4,109 @@
  * Ce code est distribué sous la licence GPLv3+.      *
  ******************************************************/
 
+#define _GNU_SOURCE
 #include <sys/mman.h>
+#include <unistd.h>
+#include <assert.h>
+#include <string.h>
 #include "mem.h"
 #include "mem_internals.h"
 
-void *emalloc_large(unsigned long size) {
-    unsigned long taille = size + 32;
+// Bytes of the pages holding size bytes and extra bytes of marks, 0 when they
+// can not be counted, no mapping could hold them anyway.
+static unsigned long segment_round(unsigned long size, unsigned long extra) {
+    unsigned long page_size = sysconf(_SC_PAGESIZE);
+    unsigned long total;
+    if (__builtin_add_overflow(size, extra + page_size - 1, &total))
+        return 0;
+    return total & ~(page_size - 1);
+}
+
+static unsigned int get_bin_index(unsigned long size) {
+    unsigned int bin_index = puiss2(size / sysconf(_SC_PAGESIZE));
+    return bin_index < LARGE_BINS ? bin_index : LARGE_BINS - 1;
+}
+
+// Large segments are mapped and unmapped out of the arena lock.
+static void count_mapped(MemArena *arena, long delta) {
+    __atomic_add_fetch(&arena->large_mapped_bytes, delta, __ATOMIC_RELAXED);
+}
+
+// The segment must be unlinked from both lists, the arena lock must be held.
+static void unlink_segment(MemArena *arena, LargeSegment *segment) {
+    if (segment->bin_prev == NULL) {
+        arena->large_bins[get_bin_index(segment->size)] = segment->bin_next;
+    } else {
+        segment->bin_prev->bin_next = segment->bin_next;
+    }
+    if (segment->bin_next != NULL) {
+        segment->bin_next->bin_prev = segment->bin_prev;
+    }
+    if (segment->lru_prev == NULL) {
+        arena->large_oldest = segment->lru_next;
+    } else {
+        segment->lru_prev->lru_next = segment->lru_next;
+    }
+    if (segment->lru_next == NULL) {
+        arena->large_newest = segment->lru_prev;
+    } else {
+        segment->lru_next->lru_prev = segment->lru_prev;
+    }
+    arena->large_cached_bytes -= segment->size;
+}
+
+// Unmap the least recently cached segments beyond the cache size, the arena lock must be held.
+void mem_trim_large(MemArena *arena) {
+    while (arena->large_cached_bytes > options.large_cache_max) {
+        LargeSegment *oldest = arena->large_oldest;
+        unsigned long size = oldest->size;
+        unlink_segment(arena, oldest);
+        if (munmap(oldest, size) == -1)
+            handle_fatalError("large free fails");
+        count_mapped(arena, -size);
+    }
+}
+
+// Take the smallest cached segment big enough from the first bin that has one, up to
+// LARGE_REUSE_MAX_FACTOR times the size, the arena lock must be held.
+static LargeSegment *take_cached_segment(MemArena *arena, unsigned long size) {
+    LargeSegment *best = NULL;
+    unsigned long page_size = sysconf(_SC_PAGESIZE);
+    unsigned long max_size = size * LARGE_REUSE_MAX_FACTOR;
+    for (unsigned int bin_index = get_bin_index(size); bin_index < LARGE_BINS && best == NULL; bin_index++) {
+        // The segments of a bin have more than half of its page count.
+        if (bin_index > get_bin_index(size) && (page_size << (bin_index - 1)) >= max_size) {
+            break;
+        }
+        for (LargeSegment *segment = arena->large_bins[bin_index]; segment != NULL; segment = segment->bin_next) {
+            if (segment->size >= size && segment->size <= max_size && (best == NULL || segment->size < best->size)) {
+                best = segment;
+                if (best->size == size) {
+                    break;
+                }
+            }
+        }
+    }
+    if (best != NULL) {
+        unlink_segment(arena, best);
+    }
+    return best;
+}
+
+// Get a cached or a fresh segment of at least taille bytes, fresh segments are zeroed.
+// NULL when taille is 0 or the system has no memory left.
+static void *get_segment(MemArena *arena, unsigned long taille, unsigned long *segment_size, bool *fresh) {
+    if (taille == 0)
+        return NULL;
+    mem_lock(arena);
+    LargeSegment *segment = take_cached_segment(arena, taille);
+    mem_unlock(arena);
+    if (segment != NULL) {
+        // The whole segment is given, its size is recorded in the mark.
+        *segment_size = segment->size;
+        *fresh = false;
+        return segment;
+    }
     void *newmem = mmap(0,
                         taille,
                         PROT_READ | PROT_WRITE | PROT_EXEC,
@@ -17,13 +114,186 @@ void *emalloc_large(unsigned long size) {
                         -1,
                         0);
     if (newmem == MAP_FAILED)
-        handle_fatalError("large alloc fails");
+        return NULL;
+    count_mapped(arena, taille);
+    *segment_size = taille;
+    *fresh = true;
+    return newmem;
+}
+
+void *emalloc_large(MemArena *arena, unsigned long size) {
+    unsigned long segment_size;
+    bool fresh;
+    if (!arena->shared) {
+        // The arena keeps its live segments linked, the mark follows the links and
+        // the segment is found back as for an aligned allocation.
+        LargeLink *link = get_segment(arena, segment_round(size, sizeof(LargeLink) + 32), &segment_size, &fresh);
+        if (link == NULL)
+            return NULL;
+        link->prev = NULL;
+        link->next = arena->large_live;
+        if (link->next != NULL) {
+            link->next->prev = link;
+        }
+        arena->large_live = link;
+        return mark_memarea_and_get_user_ptr(link + 1, segment_size - sizeof(LargeLink), LARGE_KIND);
+    }
+    void *segment = get_segment(arena, segment_round(size, 32), &segment_size, &fresh);
+    if (segment == NULL)
+        return NULL;
+    return mark_memarea_and_get_user_ptr(segment, segment_size, LARGE_KIND);
+}
+
+void *ecalloc_large(MemArena *arena, unsigned long size) {
+    // Only emalloc_large links the segments of the other arenas.
+    assert(arena->shared);
+    unsigned long segment_size;
+    bool fresh;
+    void *segment = get_segment(arena, segment_round(size, 32), &segment_size, &fresh);
+    if (segment == NULL)
+        return NULL;
+    void *ptr = mark_memarea_and_get_user_ptr(segment, segment_size, LARGE_KIND);
+    if (!fresh) {
+        // Dropping the pages of a reused segment is cheaper than writing them,
+        // they fault back zeroed. Only the first page, with the mark, is cleared by hand.
+        unsigned long page_size = sysconf(_SC_PAGESIZE);
+        if (madvise(segment + page_size, segment_size - page_size, MADV_DONTNEED) == -1)
+            handle_fatalError("large calloc fails");
+        memset(ptr, 0, page_size - 16);
+        // The footer was in the dropped pages.
+        mark_memarea_and_get_user_ptr(segment, segment_size, LARGE_KIND);
+    }
+    return ptr;
+}
+
+unsigned long get_large_segment_size(Alloc a) {
+    // The mark of an aligned allocation is inside the first page of its segment.
+    return a.size + ((unsigned long) a.ptr & (sysconf(_SC_PAGESIZE) - 1));
+}
+
+void efree_large(MemArena *arena, Alloc a) {
+    unsigned long size = get_large_segment_size(a);
+    void *base = (void *) ((unsigned long) a.ptr + a.size - size);
+    if (!arena->shared) {
+        LargeLink *link = base;
+        if (link->prev == NULL) {
+            arena->large_live = link->next;
+        } else {
+            link->prev->next = link->next;
+        }
+        if (link->next != NULL) {
+            link->next->prev = link->prev;
+        }
+    }
+    if (size > options.large_cache_max) {
+        int ret = munmap(base, size);
+        if (ret == -1)
+            handle_fatalError("large free fails");
+        count_mapped(arena, -size);
+        return;
+    }
+    // Cache the segment as the most recent one of its bin, then evict the oldest ones.
+    LargeSegment *segment = base;
+    segment->size = size;
+    mem_lock(arena);
+    unsigned int bin_index = get_bin_index(size);
+    segment->bin_prev = NULL;
+    segment->bin_next = arena->large_bins[bin_index];
+    if (segment->bin_next != NULL) {
+        segment->bin_next->bin_prev = segment;
+    }
+    arena->large_bins[bin_index] = segment;
+    segment->lru_next = NULL;
+    segment->lru_prev = arena->large_newest;
+    if (arena->large_newest == NULL) {
+        arena->large_oldest = segment;
+    } else {
+        arena->large_newest->lru_next = segment;
+    }
+    arena->large_newest = segment;
+    arena->large_cached_bytes += size;
+    mem_trim_large(arena);
+    mem_unlock(arena);
+}
 
+void *erealloc_large(MemArena *arena, Alloc a, unsigned long size) {
+    assert(arena->shared);
+    assert(size >= LARGEALLOC);
+    unsigned long taille = segment_round(size, 32);
+    if (taille == 0)
+        return NULL;
+    if (taille == a.size) {
+        return (void *) ((unsigned long) a.ptr + 16);
+    }
+    // Moving the pages of an aligned allocation would move its content away from the mark.
+    if (((unsigned long) a.ptr & (sysconf(_SC_PAGESIZE) - 1)) != 0) {
+        return NULL;
+    }
+    // The kernel moves the pages if the mapping cannot grow in place, nothing is copied.
+    // On failure the caller tries a new allocation, which fails too and keeps the old one.
+    void *newmem = mremap(a.ptr, a.size, taille, MREMAP_MAYMOVE);
+    if (newmem == MAP_FAILED)
+        return NULL;
+    count_mapped(arena, taille - a.size);
     return mark_memarea_and_get_user_ptr(newmem, taille, LARGE_KIND);
 }
 
-void efree_large(Alloc a) {
-    int ret = munmap(a.ptr, a.size);
-    if (ret == -1)
-        handle_fatalError("large free fails");
+void *ealigned_alloc_large(MemArena *arena, unsigned long size, unsigned long alignment) {
+    assert(arena->shared);
+    unsigned long page_size = sysconf(_SC_PAGESIZE);
+    void *segment;
+    unsigned long segment_size;
+    void *ptr;
+    if (alignment <= page_size) {
+        // Segments are page aligned, the mark goes right before the first aligned offset
+        // that leaves room for it, the segment holds that offset, the size and the footer.
+        unsigned long offset = (16 + alignment - 1) & ~(alignment - 1);
+        bool fresh;
+        segment = get_segment(arena, segment_round(size, offset + 16), &segment_size, &fresh);
+        if (segment == NULL)
+            return NULL;
+        ptr = segment + offset;
+    } else {
+        // Map enough to find an aligned address, then unmap the pages before its mark.
+        unsigned long taille = segment_round(size, alignment + 32);
+        if (taille == 0)
+            return NULL;
+        void *newmem = mmap(0,
+                            taille,
+                            PROT_READ | PROT_WRITE | PROT_EXEC,
+                            MAP_PRIVATE | MAP_ANONYMOUS,
+                            -1,
+                            0);
+        if (newmem == MAP_FAILED)
+            return NULL;
+        ptr = (void *) (((unsigned long) newmem + 16 + alignment - 1) & ~(alignment - 1));
+        segment = (void *) (((unsigned long) ptr - 16) & ~(page_size - 1));
+        if (segment != newmem && munmap(newmem, segment - newmem) == -1)
+            handle_fatalError("large alloc fails");
+        count_mapped(arena, taille - (segment - newmem));
+        segment_size = taille - (segment - newmem);
+    }
+    void *mark = ptr - 16;
+    return mark_memarea_and_get_user_ptr(mark, segment_size - (mark - segment), LARGE_KIND);
+}
+
+// Unmap the live and the cached segments of an arena that is not shared.
+void mem_release_large(MemArena *arena) {
+    assert(!arena->shared);
+    LargeLink *link = arena->large_live;
+    while (link != NULL) {
+        LargeLink *next = link->next;
+        // The mark after the links holds the segment size less the links.
+        unsigned long size = *((uint64_t *) (link + 1)) + sizeof(LargeLink);
+        if (munmap(link, size) == -1)
+            handle_fatalError("arena release");
+        link = next;
+    }
+    LargeSegment *segment = arena->large_oldest;
+    while (segment != NULL) {
+        LargeSegment *next = segment->lru_next;
+        if (munmap(segment, segment->size) == -1)
+            handle_fatalError("arena release");
+        segment = next;
+    }
 }
@@ -6,14 +6,18 @@
 
 #include <stdint.h>
 #include <assert.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include <stdbool.h>
+#include <string.h>
 #include "mem.h"
 #include "mem_internals.h"
 
 static uint64_t get_buddy_value(uint64_t value, uint64_t tzl_index) {
-    return value ^ (1 << tzl_index);
+    return value ^ (1UL << tzl_index);
 }
 
+// Free blocks are linked in both directions, the next block is stored first.
 static void *get_next_block(void *block) {
     uint64_t *tmp = (uint64_t *) block;
     uint64_t next_address = *tmp;
@@ -26,126 +30,500 @@ static void set_next_block(void *block, void *next) {
     *tmp = next_address;
 }
 
-static void push_on_tzl_stack(uint64_t tzl_index, void *block) {
-    void *next = arena.TZL[tzl_index];
-    uint64_t *first = (uint64_t *) block;
-    *first = (uint64_t) next;
-    arena.TZL[tzl_index] = block;
+static void *get_previous_block(void *block) {
+    uint64_t *tmp = (uint64_t *) block;
+    return (void *) tmp[1];
 }
 
-static void *pop_on_tzl_stack(uint64_t tzl_index) {
-    void *result = arena.TZL[tzl_index];
-    assert(result != NULL);
-    arena.TZL[tzl_index] = get_next_block(result);
-    set_next_block(result, NULL);
-    return result;
+static void set_previous_block(void *block, void *previous) {
+    uint64_t *tmp = (uint64_t *) block;
+    tmp[1] = (uint64_t) previous;
 }
 
-static bool is_block_in_tzl_stack(uint64_t tzl_index, uint64_t block_address) {
-    void *iterator = arena.TZL[tzl_index];
-    while (iterator != NULL) {
-        if ((uint64_t) iterator == block_address) {
-            return true;
+// Find the superblock holding an address, there is at most one superblock per order.
+// NULL if the address is out of every superblock.
+static MemSuperblock *lookup_superblock(MemArena *arena, uint64_t address, uint64_t tzl_index) {
+    for (uint64_t i = tzl_index; i < FIRST_ALLOC_MEDIUM_EXPOSANT + arena->medium_next_exponant; i++) {
+        MemSuperblock *superblock = &arena->superblocks[i];
+        if (superblock->base != NULL && (address & ~((1UL << i) - 1)) == (uint64_t) superblock->base) {
+            return superblock;
         }
-        iterator = get_next_block(iterator);
     }
-    return false;
+    return NULL;
 }
 
-static void remove_block_from_tzl_stack(uint64_t tzl_index, uint64_t block_address) {
-    // Initialization.
-    void *previous = NULL;
-    void *current = arena.TZL[tzl_index];
-    void *next = NULL;
-    // Iterate over the chunks.
-    while (current != NULL) {
-        next = get_next_block(current);
-        if ((uint64_t) current == block_address) {
-            if (previous == NULL) {
-                arena.TZL[tzl_index] = next;
-            } else {
-                set_next_block(previous, next);
-            }
-            set_next_block(current, NULL);
-            return;
-        } else {
-            previous = current;
+static MemSuperblock *find_superblock(MemArena *arena, uint64_t block_address, uint64_t tzl_index) {
+    MemSuperblock *superblock = lookup_superblock(arena, block_address, tzl_index);
+    assert(superblock != NULL);
+    return superblock;
+}
+
+static uint64_t get_superblock_index(MemArena *arena, MemSuperblock *superblock) {
+    return superblock - arena->superblocks;
+}
+
+static uint64_t get_free_map_bit(MemArena *arena, MemSuperblock *superblock, uint64_t tzl_index, uint64_t block_address) {
+    uint64_t superblock_index = get_superblock_index(arena, superblock);
+    uint64_t offset = block_address - (uint64_t) superblock->base;
+    return (1UL << (superblock_index - tzl_index)) - 1 + (offset >> tzl_index);
+}
+
+static bool test_map_bit(uint64_t *map, uint64_t bit) {
+    return (map[bit / 64] >> (bit % 64)) & 1;
+}
+
+static void set_map_bit(uint64_t *map, uint64_t bit, bool value) {
+    if (value) {
+        map[bit / 64] |= 1UL << (bit % 64);
+    } else {
+        map[bit / 64] &= ~(1UL << (bit % 64));
+    }
+}
+
+static bool is_block_free(MemArena *arena, MemSuperblock *superblock, uint64_t tzl_index, uint64_t block_address) {
+    return test_map_bit(superblock->free_map, get_free_map_bit(arena, superblock, tzl_index, block_address));
+}
+
+// A zeroed free block only holds its TZL links, that the mark overwrites.
+static void push_on_tzl_stack(MemArena *arena, MemSuperblock *superblock, uint64_t tzl_index, void *block, bool zeroed) {
+    void *next = arena->TZL[tzl_index];
+    set_next_block(block, next);
+    set_previous_block(block, NULL);
+    if (next != NULL) {
+        set_previous_block(next, block);
+    }
+    arena->TZL[tzl_index] = block;
+    arena->TZL_map |= 1UL << tzl_index;
+    arena->nb_free_blocks[tzl_index]++;
+    uint64_t bit = get_free_map_bit(arena, superblock, tzl_index, (uint64_t) block);
+    set_map_bit(superblock->free_map, bit, true);
+    set_map_bit(superblock->zero_map, bit, zeroed);
+}
+
+// Returns whether the removed block was zeroed, its links are cleared.
+static bool remove_block_from_tzl_stack(MemArena *arena, MemSuperblock *superblock, uint64_t tzl_index, void *block) {
+    void *previous = get_previous_block(block);
+    void *next = get_next_block(block);
+    if (previous == NULL) {
+        assert(arena->TZL[tzl_index] == block);
+        arena->TZL[tzl_index] = next;
+        if (next == NULL) {
+            arena->TZL_map &= ~(1UL << tzl_index);
         }
-        current = next;
+    } else {
+        set_next_block(previous, next);
+    }
+    if (next != NULL) {
+        set_previous_block(next, previous);
     }
-    assert(0);
+    set_next_block(block, NULL);
+    set_previous_block(block, NULL);
+    arena->nb_free_blocks[tzl_index]--;
+    uint64_t bit = get_free_map_bit(arena, superblock, tzl_index, (uint64_t) block);
+    set_map_bit(superblock->free_map, bit, false);
+    return test_map_bit(superblock->zero_map, bit);
 }
 
 unsigned int puiss2(unsigned long size) {
-    unsigned int p = 0;
-    size = size - 1; // allocation start in 0
-    while (size) { // get the largest bit
-        p++;
-        size >>= 1;
+    // allocation start in 0, the order is the position of the largest bit of size - 1
+    if (size <= 1)
+        return 0;
+    return 64 - __builtin_clzl(size - 1);
+}
+
+// Give the pages of the oldest fully free superblocks back until the resident ones fit
+// under the trim threshold, the arena lock must be held.
+void mem_trim_medium(MemArena *arena) {
+    while (arena->empty_bytes > options.trim_threshold) {
+        MemSuperblock *oldest = NULL;
+        for (uint64_t i = 0; i < TZL_SIZE; i++) {
+            MemSuperblock *superblock = &arena->superblocks[i];
+            if (superblock->empty_since != 0 && (oldest == NULL || superblock->empty_since < oldest->empty_since)) {
+                oldest = superblock;
+            }
+        }
+        assert(oldest != NULL);
+        // The first page keeps the TZL links of the superblock.
+        unsigned long page_size = sysconf(_SC_PAGESIZE);
+        unsigned long size = 1UL << get_superblock_index(arena, oldest);
+        if (madvise(oldest->base + page_size, size - page_size, MADV_DONTNEED) == -1)
+            handle_fatalError("medium trim");
+        // Clearing the rest of the first page makes the whole superblock zeroed again.
+        memset(oldest->base + 2 * sizeof(uint64_t), 0, page_size - 2 * sizeof(uint64_t));
+        set_map_bit(oldest->zero_map, 0, true);
+        oldest->empty_since = 0;
+        arena->empty_bytes -= size;
     }
-    if (size > (1 << p))
-        p++;
-    return p;
 }
 
-void *emalloc_medium(unsigned long size) {
-    // Validation.
-    assert(size < LARGEALLOC);
-    assert(size > SMALLALLOC);
-    // Find the first index that have at least one block free.
-    uint64_t real_size = size + 32;
-    uint64_t tzl_index = puiss2(real_size);
-    uint64_t iterator_for_find = tzl_index;
-    while (arena.TZL[iterator_for_find] == NULL) {
-        iterator_for_find++;
-        if (iterator_for_find == FIRST_ALLOC_MEDIUM_EXPOSANT + arena.medium_next_exponant) {
-            mem_realloc_medium();
-            break;
+static void superblock_emptied(MemArena *arena, MemSuperblock *superblock) {
+    superblock->empty_since = ++arena->empty_clock;
+    arena->empty_bytes += 1UL << get_superblock_index(arena, superblock);
+    mem_trim_medium(arena);
+}
+
+static void superblock_reused(MemArena *arena, MemSuperblock *superblock) {
+    if (superblock->empty_since != 0) {
+        superblock->empty_since = 0;
+        arena->empty_bytes -= 1UL << get_superblock_index(arena, superblock);
+    }
+}
+
+// Find the first index that have at least one block free, 0 if the arena must grow.
+static uint64_t find_free_tzl_index(MemArena *arena, uint64_t tzl_index) {
+    uint64_t candidates = arena->TZL_map & ~((1UL << tzl_index) - 1);
+    if (candidates == 0) {
+        return 0;
+    }
+    return __builtin_ctzl(candidates);
+}
+
+// Take a block from the shared arena, the arena lock must be held.
+// zeroed, if not NULL, tells whether the block content is known to be zero.
+static void *arena_take_block(MemArena *arena, uint64_t tzl_index, bool may_grow, bool *zeroed) {
+    uint64_t iterator_for_find = find_free_tzl_index(arena, tzl_index);
+    if (iterator_for_find == 0) {
+        if (!may_grow) {
+            return NULL;
+        }
+        // Blocks cached by this thread may merge into a large enough one before growing.
+        if (arena->shared && tcache_flush_medium()) {
+            iterator_for_find = find_free_tzl_index(arena, tzl_index);
+        }
+        while (iterator_for_find == 0) {
+            mem_realloc_medium(arena);
+            iterator_for_find = find_free_tzl_index(arena, tzl_index);
         }
     }
     // Get the first block address and delete it from the TZL.
     uint64_t iterator_for_fork = iterator_for_find;
-    uint64_t block_address = (uint64_t) arena.TZL[iterator_for_fork];
-    pop_on_tzl_stack(iterator_for_fork);
+    uint64_t block_address = (uint64_t) arena->TZL[iterator_for_fork];
+    MemSuperblock *superblock = find_superblock(arena, block_address, iterator_for_fork);
+    bool block_zeroed = remove_block_from_tzl_stack(arena, superblock, iterator_for_fork, (void *) block_address);
+    if (iterator_for_fork == get_superblock_index(arena, superblock)) {
+        superblock_reused(arena, superblock);
+    }
     // Fork bigger blocks until there is a correctly sized available block.
     while (iterator_for_fork > tzl_index) {
         iterator_for_fork--;
         // Get the buddy block address.
         uint64_t buddy_address = get_buddy_value(block_address, iterator_for_fork);
         // Add the buddy to the TZL.
-        push_on_tzl_stack(iterator_for_fork, (void *) buddy_address);
+        push_on_tzl_stack(arena, superblock, iterator_for_fork, (void *) buddy_address, block_zeroed);
+    }
+    if (zeroed != NULL) {
+        *zeroed = block_zeroed;
+    }
+    return (void *) block_address;
+}
+
+// Give a block back to the shared arena, the arena lock must be held.
+static void arena_give_block(MemArena *arena, uint64_t tzl_index, uint64_t block_address) {
+    MemSuperblock *superblock = find_superblock(arena, block_address, tzl_index);
+    uint64_t superblock_index = get_superblock_index(arena, superblock);
+    uint64_t tzl_index_iterator = tzl_index;
+    uint64_t buddy_address;
+    // Iteratively merge blocks if needed, up to the whole superblock.
+    while (tzl_index_iterator < superblock_index) {
+        // Get buddy block address, the free map tells if it is free without reading it.
+        buddy_address = get_buddy_value(block_address, tzl_index_iterator);
+        if (!is_block_free(arena, superblock, tzl_index_iterator, buddy_address)) {
+            break;
+        }
+        // Remove the buddy block from the TZL.
+        remove_block_from_tzl_stack(arena, superblock, tzl_index_iterator, (void *) buddy_address);
+        // Swap the initial block and his buddy if the buddy has a lower address than the initial block.
+        if (block_address > buddy_address) {
+            uint64_t tmp_value = block_address;
+            block_address = buddy_address;
+            buddy_address = tmp_value;
+        }
+        // Increment the TZL index iterator.
+        tzl_index_iterator++;
+    }
+    push_on_tzl_stack(arena, superblock, tzl_index_iterator, (void *) block_address, false);
+    if (tzl_index_iterator == superblock_index) {
+        superblock_emptied(arena, superblock);
+    }
+}
+
+static unsigned int tcache_capacity(uint64_t tzl_index) {
+    unsigned int capacity = TCACHE_MEDIUM_BYTES >> tzl_index;
+    return capacity < 2 ? 2 : capacity;
+}
+
+// Give cached blocks of one order back to the shared arena, the arena lock must be held.
+static void tcache_flush_order(uint64_t tzl_index, unsigned int keep) {
+    while (tcache.nb_TZL[tzl_index] > keep) {
+        void *block = tcache.TZL[tzl_index];
+        tcache.TZL[tzl_index] = get_next_block(block);
+        tcache.nb_TZL[tzl_index]--;
+        arena_give_block(&arena, tzl_index, (uint64_t) block);
     }
-    // Remove the block from the TZL, mark it and return it.
-    return mark_memarea_and_get_user_ptr((void *) block_address, real_size, MEDIUM_KIND);
 }
 
-void efree_medium(Alloc a) {
+bool tcache_flush_medium() {
+    bool flushed = false;
+    for (uint64_t i = 0; i <= TCACHE_MAX_ORDER; i++) {
+        if (tcache.nb_TZL[i] > 0) {
+            tcache_flush_order(i, 0);
+            flushed = true;
+        }
+    }
+    return flushed;
+}
+
+static void tcache_refill_medium(uint64_t tzl_index) {
+    assert(tcache.TZL[tzl_index] == NULL);
+    tcache_register();
+    unsigned int batch = tcache_capacity(tzl_index) / 4;
+    arena_lock();
+    // Only the first block may grow the arena, the others are taken while some are free.
+    void *first = arena_take_block(&arena, tzl_index, true, NULL);
+    void *last = first;
+    unsigned int nb_blocks = 1;
+    while (nb_blocks < batch) {
+        void *block = arena_take_block(&arena, tzl_index, false, NULL);
+        if (block == NULL) {
+            break;
+        }
+        // Append to keep the blocks in address order.
+        set_next_block(last, block);
+        last = block;
+        nb_blocks++;
+    }
+    arena_unlock();
+    set_next_block(last, NULL);
+    tcache.TZL[tzl_index] = first;
+    tcache.nb_TZL[tzl_index] = nb_blocks;
+}
+
+void *emalloc_medium(MemArena *arena, unsigned long size) {
+    // Validation.
+    assert(size < LARGEALLOC);
+    assert(size > SMALLALLOC);
+    uint64_t real_size = size + 32;
+    uint64_t tzl_index = puiss2(real_size);
+    void *block;
+    if (arena->medium_engine == EM_MEDIUM_TLSF) {
+        // TLSF blocks are not cached per thread.
+        mem_lock(arena);
+        block = tlsf_alloc(arena, real_size);
+        mem_unlock(arena);
+    } else if (uses_tcache(arena) && tzl_index <= TCACHE_MAX_ORDER) {
+        // Take the block from the thread cache.
+        if (tcache.TZL[tzl_index] == NULL) {
+            tcache_refill_medium(tzl_index);
+        }
+        block = tcache.TZL[tzl_index];
+        tcache.TZL[tzl_index] = get_next_block(block);
+        tcache.nb_TZL[tzl_index]--;
+    } else {
+        // Blocks too big to be cached come straight from the shared arena.
+        // The lock is a no-op out of the threaded mode.
+        mem_lock(arena);
+        block = arena_take_block(arena, tzl_index, true, NULL);
+        mem_unlock(arena);
+    }
+    // Mark the block and return it.
+    return mark_memarea_and_get_user_ptr(block, real_size, MEDIUM_KIND);
+}
+
+// The blocks are carved from larger blocks of at most the first superblock size, the
+// unused tail of the last one goes back to the TZL as the largest aligned blocks it holds.
+void emalloc_medium_batch(MemArena *arena, unsigned long size, unsigned long n, void **ptrs) {
+    // Validation.
+    assert(size < LARGEALLOC);
+    assert(size > SMALLALLOC);
+    uint64_t real_size = size + 32;
+    uint64_t tzl_index = puiss2(real_size);
+    uint64_t max_index = tzl_index > FIRST_ALLOC_MEDIUM_EXPOSANT ? tzl_index : FIRST_ALLOC_MEDIUM_EXPOSANT;
+    unsigned long i = 0;
+    if (arena->medium_engine == EM_MEDIUM_TLSF) {
+        // Neighbour blocks split one by one from the same free block.
+        mem_lock(arena);
+        for (; i < n; i++) {
+            ptrs[i] = tlsf_alloc(arena, real_size);
+        }
+        mem_unlock(arena);
+    } else if (uses_tcache(arena) && tzl_index <= TCACHE_MAX_ORDER) {
+        // The blocks of the thread cache come first.
+        while (i < n && tcache.TZL[tzl_index] != NULL) {
+            ptrs[i++] = tcache.TZL[tzl_index];
+            tcache.TZL[tzl_index] = get_next_block(ptrs[i - 1]);
+            tcache.nb_TZL[tzl_index]--;
+        }
+    }
+    mem_lock(arena);
+    while (i < n) {
+        uint64_t batch_index = tzl_index + puiss2(n - i);
+        if (batch_index > max_index) {
+            batch_index = max_index;
+        }
+        uint64_t base = (uint64_t) arena_take_block(arena, batch_index, true, NULL);
+        MemSuperblock *superblock = find_superblock(arena, base, batch_index);
+        uint64_t nb_blocks = 1UL << (batch_index - tzl_index);
+        uint64_t nb_used = n - i < nb_blocks ? n - i : nb_blocks;
+        for (uint64_t j = 0; j < nb_used; j++) {
+            ptrs[i++] = (void *) (base + (j << tzl_index));
+        }
+        for (uint64_t j = nb_used; j < nb_blocks; j += 1UL << __builtin_ctzl(j)) {
+            push_on_tzl_stack(arena, superblock, tzl_index + __builtin_ctzl(j), (void *) (base + (j << tzl_index)), false);
+        }
+    }
+    mem_unlock(arena);
+    // Mark the blocks out of the lock.
+    for (i = 0; i < n; i++) {
+        ptrs[i] = mark_memarea_and_get_user_ptr(ptrs[i], real_size, MEDIUM_KIND);
+    }
+}
+
+void efree_medium(MemArena *arena, Alloc a) {
     // Validation.
     assert(a.kind == MEDIUM_KIND);
-    assert(a.size < LARGEALLOC);
+    // The size holds the marks, requests up to LARGEALLOC - 1 are medium.
+    assert(a.size - 32 < LARGEALLOC);
     assert(a.size > SMALLALLOC);
-    // Variable initialization.
-    uint64_t tzl_index_iterator = puiss2(a.size);
+    uint64_t tzl_index = puiss2(a.size);
+    if (arena->medium_engine == EM_MEDIUM_TLSF) {
+        mem_lock(arena);
+        tlsf_free(arena, a.ptr);
+        mem_unlock(arena);
+    } else if (uses_tcache(arena) && tzl_index <= TCACHE_MAX_ORDER) {
+        if (!tcache.registered) {
+            tcache_register();
+        }
+        // Keep the block in the thread cache, give half of them back when it is full.
+        set_next_block(a.ptr, tcache.TZL[tzl_index]);
+        tcache.TZL[tzl_index] = a.ptr;
+        tcache.nb_TZL[tzl_index]++;
+        if (tcache.nb_TZL[tzl_index] > tcache_capacity(tzl_index)) {
+            mem_lock(arena);
+            tcache_flush_order(tzl_index, tcache_capacity(tzl_index) / 2);
+            mem_unlock(arena);
+        }
+    } else {
+        mem_lock(arena);
+        arena_give_block(arena, tzl_index, (uint64_t) a.ptr);
+        mem_unlock(arena);
+    }
+}
+
+// The blocks go back to the shared arena under a single lock, the thread cache is bypassed.
+void efree_medium_batch(MemArena *arena, Alloc *allocs, unsigned long n) {
+    mem_lock(arena);
+    for (unsigned long i = 0; i < n; i++) {
+        // Validation.
+        assert(allocs[i].kind == MEDIUM_KIND);
+        if (arena->medium_engine == EM_MEDIUM_TLSF) {
+            tlsf_free(arena, allocs[i].ptr);
+        } else {
+            arena_give_block(arena, puiss2(allocs[i].size), (uint64_t) allocs[i].ptr);
+        }
+    }
+    mem_unlock(arena);
+}
+
+void *erealloc_medium(MemArena *arena, Alloc a, unsigned long size) {
+    // Validation.
+    assert(a.kind == MEDIUM_KIND);
+    assert(size < LARGEALLOC);
+    assert(size > SMALLALLOC);
+    uint64_t real_size = size + 32;
+    uint64_t tzl_index = puiss2(a.size);
+    uint64_t new_tzl_index = puiss2(real_size);
     uint64_t block_address = (uint64_t) a.ptr;
-    uint64_t buddy_address;
-    // Iteratively merge blocks if needed.
-    while (tzl_index_iterator < FIRST_ALLOC_MEDIUM_EXPOSANT + arena.medium_next_exponant - 2) {
-        // Get buddy block address.
-        buddy_address = get_buddy_value(block_address, tzl_index_iterator);
-        if (is_block_in_tzl_stack(tzl_index_iterator, buddy_address)) {
-            // Remove the buddy block from the TZL.
-            remove_block_from_tzl_stack(tzl_index_iterator, buddy_address);
-            // Swap the initial block and his buddy if the buddy has a lower address than the initial block.
-            if (block_address > buddy_address) {
-                uint64_t tmp_value = block_address;
-                block_address = buddy_address;
-                buddy_address = tmp_value;
+    if (arena->medium_engine == EM_MEDIUM_TLSF) {
+        mem_lock(arena);
+        bool resized = tlsf_resize(arena, a.ptr, real_size);
+        mem_unlock(arena);
+        if (!resized) {
+            return NULL;
+        }
+    } else if (new_tzl_index < tzl_index) {
+        // Split the block, the upper halves cannot merge with the part kept.
+        mem_lock(arena);
+        MemSuperblock *superblock = find_superblock(arena, block_address, tzl_index);
+        for (uint64_t i = new_tzl_index; i < tzl_index; i++) {
+            push_on_tzl_stack(arena, superblock, i, (void *) get_buddy_value(block_address, i), false);
+        }
+        mem_unlock(arena);
+    } else if (new_tzl_index > tzl_index) {
+        // Grow only if the block stays the lower half and every upper buddy is free.
+        if ((block_address & ((1UL << new_tzl_index) - 1)) != 0) {
+            return NULL;
+        }
+        mem_lock(arena);
+        MemSuperblock *superblock = find_superblock(arena, block_address, tzl_index);
+        if (new_tzl_index > get_superblock_index(arena, superblock)) {
+            mem_unlock(arena);
+            return NULL;
+        }
+        for (uint64_t i = tzl_index; i < new_tzl_index; i++) {
+            if (!is_block_free(arena, superblock, i, get_buddy_value(block_address, i))) {
+                mem_unlock(arena);
+                return NULL;
             }
-            // Increment the TZL index iterator.
-            tzl_index_iterator++;
-        } else {
-            push_on_tzl_stack(tzl_index_iterator, (void *) block_address);
-            break;
         }
+        for (uint64_t i = tzl_index; i < new_tzl_index; i++) {
+            remove_block_from_tzl_stack(arena, superblock, i, (void *) get_buddy_value(block_address, i));
+        }
+        mem_unlock(arena);
+    }
+    // The header stays in place, only the size and the footer change.
+    return mark_memarea_and_get_user_ptr(a.ptr, real_size, MEDIUM_KIND);
+}
+
+void *ecalloc_medium(MemArena *arena, unsigned long size) {
+    // Validation.
+    assert(size < LARGEALLOC);
+    assert(size > SMALLALLOC);
+    uint64_t real_size = size + 32;
+    uint64_t tzl_index = puiss2(real_size);
+    // TLSF blocks have no zero state either.
+    if (arena->medium_engine == EM_MEDIUM_TLSF) {
+        void *ptr = emalloc_medium(arena, size);
+        memset(ptr, 0, size);
+        return ptr;
+    }
+    if (uses_tcache(arena) && tzl_index <= TCACHE_MAX_ORDER) {
+        // Cached blocks have no zero state, they are small enough to be cleared.
+        void *ptr = emalloc_medium(arena, size);
+        memset(ptr, 0, size);
+        return ptr;
+    }
+    bool zeroed;
+    mem_lock(arena);
+    void *block = arena_take_block(arena, tzl_index, true, &zeroed);
+    mem_unlock(arena);
+    void *ptr = mark_memarea_and_get_user_ptr(block, real_size, MEDIUM_KIND);
+    if (!zeroed) {
+        memset(ptr, 0, size);
+    }
+    return ptr;
+}
+
+// The mark of an aligned allocation is right before the first aligned address that
+// leaves room for it, its lead into the block is recorded in the mark. TLSF blocks are
+// cut at that place, buddy blocks are large enough to hold the lead.
+void *ealigned_alloc_medium(MemArena *arena, unsigned long size, unsigned long alignment) {
+    // Validation.
+    assert(size < LARGEALLOC);
+    assert(alignment > 16 && alignment <= FIRST_ALLOC_MEDIUM);
+    // The mark of a medium allocation holds more than SMALLALLOC bytes.
+    uint64_t real_size = (size > SMALLALLOC ? size : SMALLALLOC + 1) + 32;
+    if (arena->medium_engine == EM_MEDIUM_TLSF) {
+        mem_lock(arena);
+        void *mark = tlsf_alloc_aligned(arena, real_size, alignment);
+        mem_unlock(arena);
+        return mark_memarea_and_get_user_ptr(mark, real_size, MEDIUM_KIND);
     }
+    // Blocks are aligned on their size, at least the alignment.
+    uint64_t lead = alignment - 16;
+    assert(lead + real_size - 32 < LARGEALLOC);
+    uint64_t tzl_index = puiss2(lead + real_size);
+    mem_lock(arena);
+    void *block = arena_take_block(arena, tzl_index, true, NULL);
+    mem_unlock(arena);
+    return mark_aligned_memarea_and_get_user_ptr(block, lead, real_size);
 }
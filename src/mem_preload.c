@@ -0,0 +1,100 @@
+/******************************************************
+ * Copyright Grégory Mounié 2018                      *
+ * This code is distributed under the GLPv3+ licence. *
+ * Ce code est distribué sous la licence GPLv3+.      *
+ ******************************************************/
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "mem.h"
+#include "mem_internals.h"
+
+/*
+ * The standard allocation functions on top of emalloc, for LD_PRELOAD.
+ *
+ * The allocator needs no initialization and only calls the system, never
+ * the C library allocator, so that a libc function allocating on behalf of
+ * emalloc can not recurse into it. All the state is statically initialized,
+ * malloc may be called before any constructor.
+ */
+
+#define EXPORT __attribute__((visibility("default")))
+
+// A fork while another thread holds the arena lock would leave it locked in the child.
+// EMALLOC_TRACE names the trace file of the whole run.
+__attribute__((constructor)) static void preload_init() {
+    pthread_atfork(arena_lock, arena_unlock, arena_unlock);
+    const char *trace_path = getenv("EMALLOC_TRACE");
+    if (trace_path != NULL && emalloc_trace_start(trace_path) == -1)
+        perror("EMALLOC_TRACE");
+}
+
+__attribute__((destructor)) static void preload_fini() {
+    emalloc_trace_stop();
+}
+
+EXPORT void *malloc(size_t size) {
+    // Every call returns a distinct pointer, even for 0 bytes.
+    void *ptr = emalloc(size == 0 ? 1 : size);
+    if (ptr == NULL)
+        errno = ENOMEM;
+    return ptr;
+}
+
+EXPORT void free(void *ptr) {
+    if (ptr != NULL)
+        efree(ptr);
+}
+
+EXPORT void *calloc(size_t nmemb, size_t size) {
+    if (nmemb == 0 || size == 0)
+        return malloc(0);
+    void *ptr = ecalloc(nmemb, size);
+    if (ptr == NULL)
+        errno = ENOMEM;
+    return ptr;
+}
+
+EXPORT void *realloc(void *ptr, size_t size) {
+    if (ptr == NULL)
+        return malloc(size);
+    void *result = erealloc(ptr, size);
+    if (result == NULL && size != 0)
+        errno = ENOMEM;
+    return result;
+}
+
+EXPORT int posix_memalign(void **memptr, size_t alignment, size_t size) {
+    return eposix_memalign(memptr, alignment, size == 0 ? 1 : size);
+}
+
+EXPORT void *aligned_alloc(size_t alignment, size_t size) {
+    void *ptr = ealigned_alloc(alignment, size == 0 ? 1 : size);
+    if (ptr == NULL)
+        errno = alignment == 0 || (alignment & (alignment - 1)) != 0 ? EINVAL : ENOMEM;
+    return ptr;
+}
+
+// The obsolete functions use the same heap, their blocks may be given to free.
+EXPORT void *memalign(size_t alignment, size_t size) {
+    // Any alignment is accepted, rounded up to a power of two.
+    if (alignment > 1 && (alignment & (alignment - 1)) != 0)
+        alignment = 2UL << (63 - __builtin_clzl(alignment));
+    return aligned_alloc(alignment == 0 ? 1 : alignment, size);
+}
+
+EXPORT void *valloc(size_t size) {
+    return memalign(sysconf(_SC_PAGESIZE), size);
+}
+
+EXPORT void *pvalloc(size_t size) {
+    unsigned long page_size = sysconf(_SC_PAGESIZE);
+    return memalign(page_size, (size + page_size - 1) & ~(page_size - 1));
+}
+
+EXPORT size_t malloc_usable_size(void *ptr) {
+    return emalloc_usable_size(ptr);
+}
@@ -0,0 +1,108 @@
+/******************************************************
+ * Copyright Grégory Mounié 2018                      *
+ * This code is distributed under the GLPv3+ licence. *
+ * Ce code est distribué sous la licence GPLv3+.      *
+ ******************************************************/
+
+#include <stdint.h>
+#include <assert.h>
+#include "mem.h"
+#include "mem_internals.h"
+
+// Objects are rounded to keep the next one aligned, chunks start aligned on 16 bytes.
+#define REGION_ALIGNMENT 16
+
+static RegionChunk *new_chunk(RegionChunk *prev, unsigned long size) {
+    // A medium block of REGION_CHUNK_SIZE bytes once its mark is counted.
+    unsigned long chunk_size = REGION_CHUNK_SIZE - 32;
+    if (size > chunk_size - sizeof(RegionChunk))
+        chunk_size = size + sizeof(RegionChunk);
+    RegionChunk *chunk = emalloc(chunk_size);
+    if (chunk == NULL)
+        return NULL;
+    chunk->prev = prev;
+    chunk->end = (char *) chunk + chunk_size;
+    return chunk;
+}
+
+static void use_chunk(MemRegion *region, RegionChunk *chunk) {
+    region->chunk = chunk;
+    region->top = (char *) (chunk + 1);
+    region->end = chunk->end;
+}
+
+ERegion *eregion_create(void) {
+    RegionChunk *chunk = new_chunk(NULL, 0);
+    if (chunk == NULL)
+        return NULL;
+    MemRegion *region = (MemRegion *) (chunk + 1);
+    use_chunk(region, chunk);
+    region->top += (sizeof(MemRegion) + REGION_ALIGNMENT - 1) & ~(REGION_ALIGNMENT - 1UL);
+    region->spare = NULL;
+    return region;
+}
+
+// The rest of the current chunk is given up, the object goes to a new one.
+__attribute__((noinline))
+static void *region_grow(MemRegion *region, unsigned long size, unsigned long rounded) {
+    // Rounding a size of 0 or close to the end of the address space wraps.
+    if (rounded < size || rounded == 0 || rounded > UINTPTR_MAX / 2)
+        return NULL;
+    RegionChunk *chunk = region->spare;
+    if (chunk != NULL && (unsigned long) (chunk->end - (char *) (chunk + 1)) >= rounded) {
+        region->spare = NULL;
+        chunk->prev = region->chunk;
+    } else {
+        chunk = new_chunk(region->chunk, rounded);
+        if (chunk == NULL)
+            return NULL;
+    }
+    use_chunk(region, chunk);
+    void *ptr = region->top;
+    region->top += rounded;
+    return ptr;
+}
+
+void *eregion_alloc(ERegion *region, unsigned long size) {
+    unsigned long rounded = (size + REGION_ALIGNMENT - 1) & ~(REGION_ALIGNMENT - 1UL);
+    // A size of 0 wraps to the largest value and goes to region_grow too.
+    if (__builtin_expect(rounded - 1 >= (unsigned long) (region->end - region->top), 0))
+        return region_grow(region, size, rounded);
+    void *ptr = region->top;
+    region->top += rounded;
+    return ptr;
+}
+
+ERegionMark eregion_mark(ERegion *region) {
+    return (ERegionMark) {region->chunk, region->top};
+}
+
+void eregion_release(ERegion *region, ERegionMark mark) {
+    // The chunks filled since the mark are given back, the last one of the usual
+    // size is kept so that a loop of mark and release around a chunk boundary
+    // does not go back and forth to emalloc.
+    while (region->chunk != mark.chunk) {
+        RegionChunk *chunk = region->chunk;
+        assert(chunk->prev != NULL);
+        region->chunk = chunk->prev;
+        if (chunk->end - (char *) chunk == REGION_CHUNK_SIZE - 32 && region->spare == NULL)
+            region->spare = chunk;
+        else
+            efree_sized(chunk, chunk->end - (char *) chunk);
+    }
+    assert((char *) mark.top >= (char *) (region->chunk + 1) && (char *) mark.top <= region->chunk->end);
+    region->top = mark.top;
+    region->end = region->chunk->end;
+}
+
+void eregion_destroy(ERegion *region) {
+    RegionChunk *chunk = region->chunk;
+    if (region->spare != NULL)
+        efree_sized(region->spare, region->spare->end - (char *) region->spare);
+    // The region itself is in the first chunk, freed last.
+    while (chunk != NULL) {
+        RegionChunk *prev = chunk->prev;
+        efree_sized(chunk, chunk->end - (char *) chunk);
+        chunk = prev;
+    }
+}
@@ -5,32 +5,290 @@
  ******************************************************/
 
 #include <assert.h>
+#include <stdint.h>
 #include "mem.h"
 #include "mem_internals.h"
 
-void *emalloc_small(unsigned long size) {
+/*
+ * The shared pool of a class is a Treiber stack. Its head packs the offset of the
+ * top chunk in the small region, 0 when empty, with a tag in the upper bits that
+ * every change increments: a head read before another thread pops a chunk and
+ * pushes it back no longer matches, which protects the exchanges from ABA.
+ * Threads only lock the arena to carve new chunks.
+ */
+#define POOL_TAG_UNIT (1UL << SMALL_REGION_EXPOSANT)
+
+static void *pool_top(MemArena *arena, uint64_t head) {
+    uint64_t offset = head & (POOL_TAG_UNIT - 1);
+    return offset == 0 ? NULL : arena->small_region + offset;
+}
+
+static uint64_t pool_next_head(MemArena *arena, uint64_t head, void *top) {
+    uint64_t offset = top == NULL ? 0 : (uint64_t) ((char *) top - arena->small_region);
+    return ((head & ~(POOL_TAG_UNIT - 1)) + POOL_TAG_UNIT) | offset;
+}
+
+// Push the run from first to last, already linked, at once.
+static void pool_push_run(MemArena *arena, unsigned int size_class, void *first, void *last) {
+    uint64_t head = __atomic_load_n(&arena->chunkpool[size_class], __ATOMIC_RELAXED);
+    do {
+        *((void **) last) = pool_top(arena, head);
+    } while (!__atomic_compare_exchange_n(&arena->chunkpool[size_class], &head, pool_next_head(arena, head, first), true,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+// Detach a run of at most max chunks, NULL if the pool is empty.
+static void *pool_pop_run(MemArena *arena, unsigned int size_class, unsigned int max, unsigned int *nb_chunks) {
+    uint64_t head = __atomic_load_n(&arena->chunkpool[size_class], __ATOMIC_ACQUIRE);
+    void *first;
+    void *last;
+    void *next;
+    unsigned int nb;
+    do {
+        first = pool_top(arena, head);
+        if (first == NULL) {
+            return NULL;
+        }
+        // The chunks may be popped and written by other threads meanwhile: links out of
+        // the small region are not followed, and the changed tag fails the exchange.
+        last = first;
+        nb = 1;
+        next = __atomic_load_n((void **) last, __ATOMIC_RELAXED);
+        while (nb < max && next != NULL && is_small_chunk(arena, next)) {
+            last = next;
+            nb++;
+            next = __atomic_load_n((void **) last, __ATOMIC_RELAXED);
+        }
+        if (next != NULL && !is_small_chunk(arena, next)) {
+            head = __atomic_load_n(&arena->chunkpool[size_class], __ATOMIC_ACQUIRE);
+            continue;
+        }
+        if (__atomic_compare_exchange_n(&arena->chunkpool[size_class], &head, pool_next_head(arena, head, next), true,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+    } while (true);
+    *((void **) last) = NULL;
+    *nb_chunks = nb;
+    return first;
+}
+
+/*
+ * The slabs of a new run are not linked in the pool at once, which would touch
+ * every page of the run: the tail of the run is carved into chunks on demand,
+ * and only the chunks carved are written. Every slab gets its header when its
+ * first chunk is carved.
+ * The arena lock must be held. Carve a run of at most max chunks, growing the
+ * tail if it is empty.
+ */
+static void *carve_chunks(MemArena *arena, unsigned int size_class, unsigned int max, unsigned int *nb_chunks) {
+    u_int64_t chunk_size = SMALL_CHUNKSIZE(size_class);
+    char *tail = arena->small_tail[size_class];
+    if (tail == arena->small_tail_end[size_class]) {
+        u_int64_t nb_slabs = mem_realloc_small(arena, size_class, &tail);
+        arena->small_tail_end[size_class] = tail + nb_slabs * SLAB_SIZE;
+    }
+    void *first = NULL;
+    void **link = &first;
+    unsigned int nb = 0;
+    while (nb < max && tail != arena->small_tail_end[size_class]) {
+        // The tail is either at the start of a slab or at its next chunk.
+        if (((u_int64_t) tail & (SLAB_SIZE - 1)) == 0) {
+            MemSlab *slab = (MemSlab *) tail;
+            slab->magic = SLAB_MAGIC;
+            slab->size_class = size_class;
+            tail += SLAB_HEADER;
+        }
+        *link = tail;
+        link = (void **) tail;
+        tail += chunk_size;
+        nb++;
+        // Skip the end of the slab when it has no room for another chunk.
+        if (((u_int64_t) tail & (SLAB_SIZE - 1)) + chunk_size > SLAB_SIZE) {
+            tail = (char *) (((u_int64_t) tail + SLAB_SIZE - 1) & ~(SLAB_SIZE - 1));
+        }
+    }
+    *link = NULL;
+    arena->small_tail[size_class] = tail;
+    arena->small_chunks[size_class] += nb;
+    *nb_chunks = nb;
+    return first;
+}
+
+// Detach a run of at most max chunks, carving new ones if the pool is empty.
+static void *pool_pop_or_carve(MemArena *arena, unsigned int size_class, unsigned int max, unsigned int *nb_chunks) {
+    void *first = pool_pop_run(arena, size_class, max, nb_chunks);
+    if (first == NULL) {
+        // The chunks freed by other threads meanwhile are left for the next pop.
+        mem_lock(arena);
+        first = carve_chunks(arena, size_class, max, nb_chunks);
+        mem_unlock(arena);
+    }
+    return first;
+}
+
+static void tcache_refill_small(unsigned int size_class) {
+    assert(tcache.chunkpool[size_class] == NULL);
+    tcache_register();
+    // Detach a run of at most half the cache capacity from the shared pool.
+    tcache.chunkpool[size_class] = pool_pop_or_carve(&arena, size_class, TCACHE_SMALL_MAX / 2,
+                                                    &tcache.nb_chunks[size_class]);
+}
+
+void tcache_flush_small(unsigned int size_class, unsigned int keep) {
+    if (tcache.nb_chunks[size_class] <= keep) {
+        return;
+    }
+    // Split the cached stack after the kept chunks.
+    void **last_kept = NULL;
+    void *first = tcache.chunkpool[size_class];
+    for (unsigned int i = 0; i < keep; i++) {
+        last_kept = (void **) first;
+        first = *last_kept;
+    }
+    if (last_kept == NULL) {
+        tcache.chunkpool[size_class] = NULL;
+    } else {
+        *last_kept = NULL;
+    }
+    // Find the end of the flushed run.
+    void **last = (void **) first;
+    while (*last != NULL) {
+        last = (void **) *last;
+    }
+    // Push the whole run on the shared pool at once.
+    pool_push_run(&arena, size_class, first, last);
+    tcache.nb_chunks[size_class] = keep;
+}
+
+void *emalloc_small(MemArena *arena, unsigned long size) {
+    // Validation.
+    assert(size > 0 && size <= 64);
+    unsigned int size_class = SMALL_CLASS(size);
+    void *chunk;
+    if (uses_tcache(arena)) {
+        // Refill the thread cache if needed and take its first chunk.
+        if (tcache.chunkpool[size_class] == NULL) {
+            tcache_refill_small(size_class);
+        }
+        chunk = tcache.chunkpool[size_class];
+        tcache.chunkpool[size_class] = *((void **) chunk);
+        tcache.nb_chunks[size_class]--;
+    } else {
+        // Take the first chunk, or carve a new one, nothing runs concurrently.
+        uint64_t head = arena->chunkpool[size_class];
+        chunk = pool_top(arena, head);
+        if (chunk == NULL) {
+            unsigned int nb_chunks;
+            return carve_chunks(arena, size_class, 1, &nb_chunks);
+        }
+        arena->chunkpool[size_class] = pool_next_head(arena, head, *((void **) chunk));
+    }
+    // The chunk is given without a mark.
+    return chunk;
+}
+
+// The chunks of one class are detached from the pools in a single pass.
+void emalloc_small_batch(MemArena *arena, unsigned long size, unsigned long n, void **ptrs) {
     // Validation.
     assert(size > 0 && size <= 64);
-    // Create new chunks if needed.
-    if (arena.chunkpool == NULL) {
-        // Realloc new chunks.
-        u_int64_t nb_chunks_reallocated = mem_realloc_small() / CHUNKSIZE;
-        // Link chunks between them.
-        for (u_int64_t i = 0; i < nb_chunks_reallocated - 1; i++) {
-            void **current = (void **) ((u_int64_t) arena.chunkpool + i * CHUNKSIZE);
-            void *next = (void *) ((u_int64_t) current + CHUNKSIZE);
-            *current = next;
-        }
-        // Set the last chunk pointer to null.
-        *((void **) ((u_int64_t) arena.chunkpool + (nb_chunks_reallocated - 1) * CHUNKSIZE)) = NULL;
-    }
-    // Take first chunk and mark it.
-    void *chunk = arena.chunkpool;
-    arena.chunkpool = *((void **) arena.chunkpool);
-    return mark_memarea_and_get_user_ptr(chunk, CHUNKSIZE, SMALL_KIND);
-}
-
-void efree_small(Alloc a) {
-    *((void **) a.ptr) = arena.chunkpool;
-    arena.chunkpool = a.ptr;
+    unsigned int size_class = SMALL_CLASS(size);
+    unsigned long i = 0;
+    if (uses_tcache(arena)) {
+        // The chunks of the thread cache come first.
+        void *chunk = tcache.chunkpool[size_class];
+        while (i < n && chunk != NULL) {
+            ptrs[i++] = chunk;
+            chunk = *((void **) chunk);
+        }
+        tcache.chunkpool[size_class] = chunk;
+        tcache.nb_chunks[size_class] -= i;
+    }
+    // The rest comes from the shared pool by runs.
+    while (i < n) {
+        unsigned int nb_chunks;
+        unsigned int max = n - i < TCACHE_SMALL_MAX ? n - i : TCACHE_SMALL_MAX;
+        void *chunk = pool_pop_or_carve(arena, size_class, max, &nb_chunks);
+        while (chunk != NULL) {
+            ptrs[i++] = chunk;
+            chunk = *((void **) chunk);
+        }
+    }
+}
+
+// The size class is known, the slab header is not read.
+void efree_small_class(MemArena *arena, void *ptr, unsigned int size_class) {
+    if (!uses_tcache(arena)) {
+        // Nothing runs concurrently.
+        uint64_t head = arena->chunkpool[size_class];
+        *((void **) ptr) = pool_top(arena, head);
+        arena->chunkpool[size_class] = pool_next_head(arena, head, ptr);
+        return;
+    }
+    if (!tcache.registered) {
+        tcache_register();
+    }
+    *((void **) ptr) = tcache.chunkpool[size_class];
+    tcache.chunkpool[size_class] = ptr;
+    tcache.nb_chunks[size_class]++;
+    // Give half of the chunks back to the shared pool when the cache is full.
+    if (tcache.nb_chunks[size_class] > TCACHE_SMALL_MAX) {
+        tcache_flush_small(size_class, TCACHE_SMALL_MAX / 2);
+    }
+}
+
+void efree_small(MemArena *arena, void *ptr) {
+    // The slab header gives back the size class.
+    MemSlab *slab = get_slab(ptr);
+    if (options.check_level >= EM_CHECK_CANARY && slab->magic != SLAB_MAGIC)
+        mark_corrupted(ptr, "slab header");
+    unsigned int size_class = slab->size_class;
+    assert(((uint64_t) ptr - (uint64_t) slab - SLAB_HEADER) % SMALL_CHUNKSIZE(size_class) == 0);
+    efree_small_class(arena, ptr, size_class);
+}
+
+// Frees the small chunks of ptrs and counts them per class in nb_freed, the other pointers are left.
+// The chunks are linked per class and each list is pushed at once.
+void efree_small_batch(MemArena *arena, void **ptrs, unsigned long n, unsigned long *nb_freed) {
+    void *first[SMALL_CLASSES] = {};
+    void *last[SMALL_CLASSES] = {};
+    // Neighbour chunks share their slab, its header is only checked once for them.
+    MemSlab *checked = NULL;
+    unsigned int size_class = 0;
+    for (unsigned long i = 0; i < n; i++) {
+        void *ptr = ptrs[i];
+        if (!is_small_chunk(arena, ptr))
+            continue;
+        MemSlab *slab = get_slab(ptr);
+        if (slab != checked) {
+            if (options.check_level >= EM_CHECK_CANARY && slab->magic != SLAB_MAGIC)
+                mark_corrupted(ptr, "slab header");
+            checked = slab;
+            size_class = slab->size_class;
+        }
+        assert(((uint64_t) ptr - (uint64_t) slab - SLAB_HEADER) % SMALL_CHUNKSIZE(size_class) == 0);
+        *((void **) ptr) = first[size_class];
+        if (first[size_class] == NULL) {
+            last[size_class] = ptr;
+        }
+        first[size_class] = ptr;
+        nb_freed[size_class]++;
+    }
+    for (unsigned int c = 0; c < SMALL_CLASSES; c++) {
+        if (first[c] == NULL)
+            continue;
+        if (!uses_tcache(arena)) {
+            pool_push_run(arena, c, first[c], last[c]);
+            continue;
+        }
+        if (!tcache.registered) {
+            tcache_register();
+        }
+        *((void **) last[c]) = tcache.chunkpool[c];
+        tcache.chunkpool[c] = first[c];
+        tcache.nb_chunks[c] += nb_freed[c];
+        if (tcache.nb_chunks[c] > TCACHE_SMALL_MAX) {
+            tcache_flush_small(c, TCACHE_SMALL_MAX / 2);
+        }
+    }
 }
@@ -0,0 +1,84 @@
+/******************************************************
+ * Copyright Grégory Mounié 2018                      *
+ * This code is distributed under the GLPv3+ licence. *
+ * Ce code est distribué sous la licence GPLv3+.      *
+ ******************************************************/
+
+#include <pthread.h>
+#include "mem.h"
+#include "mem_internals.h"
+
+__thread ThreadCache tcache = {};
+
+static pthread_mutex_t arena_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t tcache_once = PTHREAD_ONCE_INIT;
+static pthread_key_t tcache_key;
+
+// The lock is only taken in threaded mode.
+void arena_lock() {
+    if (!options.threaded)
+        return;
+    if (pthread_mutex_lock(&arena_mutex) != 0)
+        handle_fatalError("arena lock");
+    // The counters of the thread are merged while it holds the lock anyway.
+    tcache_merge_counters();
+}
+
+void arena_unlock() {
+    if (options.threaded && pthread_mutex_unlock(&arena_mutex) != 0)
+        handle_fatalError("arena unlock");
+}
+
+void tcache_merge_counters() {
+    MemCounters *counters = &tcache.counters;
+    for (unsigned int i = 0; i < 3; i++) {
+        arena.counters.nb_alloc[i] += counters->nb_alloc[i];
+        arena.counters.nb_free[i] += counters->nb_free[i];
+    }
+    for (unsigned int i = 0; i < SMALL_CLASSES; i++) {
+        arena.counters.small_live[i] += counters->small_live[i];
+    }
+    arena.counters.live_bytes += counters->live_bytes;
+    arena.counters.requested_bytes += counters->requested_bytes;
+    arena.counters.block_bytes += counters->block_bytes;
+    *counters = (MemCounters) {};
+}
+
+static void tcache_destroy(void *unused) {
+    // Give every cached chunk and block back to the shared arena when the thread exits.
+    tcache.registered = false;
+    for (unsigned int i = 0; i < SMALL_CLASSES; i++) {
+        tcache_flush_small(i, 0);
+    }
+    arena_lock();
+    tcache_flush_medium();
+    // Merged again in case the threaded mode was left meanwhile.
+    tcache_merge_counters();
+    arena_unlock();
+}
+
+static void tcache_create_key() {
+    if (pthread_key_create(&tcache_key, tcache_destroy) != 0)
+        handle_fatalError("thread cache key");
+}
+
+void tcache_register() {
+    if (tcache.registered)
+        return;
+    // Set first: pthread_setspecific may allocate, which must not register again.
+    tcache.registered = true;
+    pthread_once(&tcache_once, tcache_create_key);
+    // The value only needs to be non NULL for the destructor to be called.
+    pthread_setspecific(tcache_key, &tcache);
+}
+
+// Other arenas are used by one thread at a time, only the main one is locked.
+void mem_lock(MemArena *arena) {
+    if (arena->shared)
+        arena_lock();
+}
+
+void mem_unlock(MemArena *arena) {
+    if (arena->shared)
+        arena_unlock();
+}
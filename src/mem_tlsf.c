@@ -0,0 +1,195 @@
+/******************************************************
+ * Copyright Grégory Mounié 2018                      *
+ * This code is distributed under the GLPv3+ licence. *
+ * Ce code est distribué sous la licence GPLv3+.      *
+ ******************************************************/
+
+#include <stdint.h>
+#include <assert.h>
+#include <stdbool.h>
+#include "mem.h"
+#include "mem_internals.h"
+
+/*
+ * Two level segregated fit: the free blocks of 2**fl up to 2**(fl+1) - 1 bytes
+ * are split in TLSF_SL_COUNT lists of equal ranges. A request is rounded up to the
+ * next range, any block of that list fits, and two bit scans over the maps find
+ * the first list that is not empty: allocation and free are constant time.
+ * Blocks are split to the size of the request, and merged with their free
+ * physical neighbours on free, so two free blocks are never next to each other.
+ * The arena lock must be held.
+ */
+#define TLSF_FREE 1UL
+
+static unsigned long get_block_size(TlsfBlock *block) {
+    return block->size & ~TLSF_FREE;
+}
+
+static bool is_block_free(TlsfBlock *block) {
+    return block->size & TLSF_FREE;
+}
+
+static TlsfBlock *get_next_phys(TlsfBlock *block) {
+    return (TlsfBlock *) ((char *) block + get_block_size(block));
+}
+
+static void mapping_insert(unsigned long size, unsigned int *fl, unsigned int *sl) {
+    *fl = 63 - __builtin_clzl(size);
+    *sl = (size >> (*fl - TLSF_SL_LOG2)) & (TLSF_SL_COUNT - 1);
+}
+
+// Round the size up to the next range, every block of its list is large enough.
+static void mapping_search(unsigned long size, unsigned int *fl, unsigned int *sl) {
+    size += (1UL << (63 - __builtin_clzl(size) - TLSF_SL_LOG2)) - 1;
+    mapping_insert(size, fl, sl);
+}
+
+static void insert_free_block(MemArena *arena, TlsfBlock *block) {
+    unsigned int fl, sl;
+    mapping_insert(block->size, &fl, &sl);
+    TlsfBlock *next = arena->tlsf_free[fl][sl];
+    block->size |= TLSF_FREE;
+    block->next_free = next;
+    block->prev_free = NULL;
+    if (next != NULL) {
+        next->prev_free = block;
+    }
+    arena->tlsf_free[fl][sl] = block;
+    arena->tlsf_sl_map[fl] |= 1U << sl;
+    arena->tlsf_fl_map |= 1UL << fl;
+    arena->nb_free_blocks[fl]++;
+}
+
+static void remove_free_block(MemArena *arena, TlsfBlock *block) {
+    unsigned int fl, sl;
+    block->size &= ~TLSF_FREE;
+    mapping_insert(block->size, &fl, &sl);
+    if (block->prev_free == NULL) {
+        assert(arena->tlsf_free[fl][sl] == block);
+        arena->tlsf_free[fl][sl] = block->next_free;
+        if (block->next_free == NULL) {
+            arena->tlsf_sl_map[fl] &= ~(1U << sl);
+            if (arena->tlsf_sl_map[fl] == 0) {
+                arena->tlsf_fl_map &= ~(1UL << fl);
+            }
+        }
+    } else {
+        block->prev_free->next_free = block->next_free;
+    }
+    if (block->next_free != NULL) {
+        block->next_free->prev_free = block->prev_free;
+    }
+    arena->nb_free_blocks[fl]--;
+}
+
+// First block of the first list large enough, NULL if the arena must grow.
+static TlsfBlock *find_free_block(MemArena *arena, unsigned long size) {
+    unsigned int fl, sl;
+    mapping_search(size, &fl, &sl);
+    uint32_t sl_map = arena->tlsf_sl_map[fl] & (~0U << sl);
+    if (sl_map == 0) {
+        uint64_t fl_map = arena->tlsf_fl_map & (~0UL << (fl + 1));
+        if (fl_map == 0) {
+            return NULL;
+        }
+        fl = __builtin_ctzl(fl_map);
+        sl_map = arena->tlsf_sl_map[fl];
+    }
+    return arena->tlsf_free[fl][__builtin_ctz(sl_map)];
+}
+
+// Free a used block, merged with its free neighbours.
+static void release_block(MemArena *arena, TlsfBlock *block) {
+    TlsfBlock *next = get_next_phys(block);
+    if (is_block_free(next)) {
+        remove_free_block(arena, next);
+        block->size += next->size;
+        get_next_phys(block)->prev_phys = block;
+    }
+    TlsfBlock *previous = block->prev_phys;
+    if (previous != NULL && is_block_free(previous)) {
+        remove_free_block(arena, previous);
+        previous->size += block->size;
+        get_next_phys(previous)->prev_phys = previous;
+        block = previous;
+    }
+    insert_free_block(arena, block);
+}
+
+// Keep size bytes of a used block, the tail is freed when it is large enough.
+static void split_block(MemArena *arena, TlsfBlock *block, unsigned long size) {
+    unsigned long rest = block->size - size;
+    if (rest < TLSF_MIN_BLOCK) {
+        return;
+    }
+    TlsfBlock *tail = (TlsfBlock *) ((char *) block + size);
+    tail->prev_phys = block;
+    tail->size = rest;
+    get_next_phys(tail)->prev_phys = tail;
+    block->size = size;
+    release_block(arena, tail);
+}
+
+// Returns where the mark of real_size bytes goes.
+void *tlsf_alloc(MemArena *arena, unsigned long real_size) {
+    unsigned long size = TLSF_BLOCK_SIZE(real_size);
+    TlsfBlock *block = find_free_block(arena, size);
+    while (block == NULL) {
+        insert_free_block(arena, mem_realloc_tlsf(arena));
+        block = find_free_block(arena, size);
+    }
+    remove_free_block(arena, block);
+    split_block(arena, block, size);
+    return (char *) block + TLSF_HEADER;
+}
+
+// The block is over-allocated by the alignment, the lead before the aligned mark is freed.
+void *tlsf_alloc_aligned(MemArena *arena, unsigned long real_size, unsigned long alignment) {
+    unsigned long size = TLSF_BLOCK_SIZE(real_size);
+    TlsfBlock *block = find_free_block(arena, size + alignment + TLSF_MIN_BLOCK);
+    while (block == NULL) {
+        insert_free_block(arena, mem_realloc_tlsf(arena));
+        block = find_free_block(arena, size + alignment + TLSF_MIN_BLOCK);
+    }
+    remove_free_block(arena, block);
+    // The user pointer follows the header and the mark, a shorter lead cannot be a block.
+    uint64_t user = (uint64_t) block + TLSF_HEADER + 16;
+    unsigned long lead = ((user + alignment - 1) & ~(alignment - 1)) - user;
+    while (lead != 0 && lead < TLSF_MIN_BLOCK) {
+        lead += alignment;
+    }
+    if (lead != 0) {
+        TlsfBlock *aligned = (TlsfBlock *) ((char *) block + lead);
+        aligned->prev_phys = block;
+        aligned->size = block->size - lead;
+        get_next_phys(aligned)->prev_phys = aligned;
+        block->size = lead;
+        release_block(arena, block);
+        block = aligned;
+    }
+    split_block(arena, block, size);
+    return (char *) block + TLSF_HEADER;
+}
+
+void tlsf_free(MemArena *arena, void *ptr) {
+    TlsfBlock *block = (TlsfBlock *) ((char *) ptr - TLSF_HEADER);
+    assert(!is_block_free(block));
+    release_block(arena, block);
+}
+
+// Shrink the block, or grow it over its next block when it is free and large enough.
+bool tlsf_resize(MemArena *arena, void *ptr, unsigned long real_size) {
+    TlsfBlock *block = (TlsfBlock *) ((char *) ptr - TLSF_HEADER);
+    unsigned long size = TLSF_BLOCK_SIZE(real_size);
+    if (size > block->size) {
+        TlsfBlock *next = get_next_phys(block);
+        if (!is_block_free(next) || block->size + get_block_size(next) < size) {
+            return false;
+        }
+        remove_free_block(arena, next);
+        block->size += next->size;
+        get_next_phys(block)->prev_phys = block;
+    }
+    split_block(arena, block, size);
+    return true;
+}
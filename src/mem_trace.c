@@ -0,0 +1,208 @@
+/******************************************************
+ * Copyright Grégory Mounié 2018                      *
+ * This code is distributed under the GLPv3+ licence. *
+ * Ce code est distribué sous la licence GPLv3+.      *
+ ******************************************************/
+
+#define _GNU_SOURCE
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <limits.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include "mem.h"
+#include "mem_internals.h"
+
+// Events of a thread wait in a ring buffer for the flusher.
+#define TRACE_BUFFER_EVENTS 8192
+// The flusher wakes up every 10 ms.
+#define TRACE_FLUSH_PERIOD_NS 10000000
+
+/*
+ * The ring buffer of a thread has a single producer, the thread, and a single
+ * consumer, the flusher: head is only written by the thread and tail by the
+ * flusher, the events between them are published by the release store of head.
+ * The buffer of an exited thread is taken over by the next new thread. Destructors
+ * that run after its release may still allocate, the thread then registers again.
+ */
+typedef struct _TraceBuffer {
+    struct _TraceBuffer *next;
+    unsigned long head;
+    unsigned long tail;
+    unsigned long dropped;
+    bool exited;
+    EmallocTraceEvent events[TRACE_BUFFER_EVENTS];
+} TraceBuffer;
+
+static __thread TraceBuffer *trace_buffer;
+static __thread unsigned int trace_thread;
+
+// Buffers are only added to the list, until the trace stops.
+static TraceBuffer *trace_buffers;
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+static pthread_key_t trace_key;
+static pthread_t trace_flusher;
+static bool trace_stopping;
+static int trace_fd = -1;
+
+static unsigned long long trace_timestamp() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+#endif
+}
+
+static void trace_thread_exit(void *buffer) {
+    // Forgotten before it is given back, another thread may take it at once.
+    trace_buffer = NULL;
+    __atomic_store_n(&((TraceBuffer *) buffer)->exited, true, __ATOMIC_RELEASE);
+}
+
+static void trace_create_key() {
+    if (pthread_key_create(&trace_key, trace_thread_exit) != 0)
+        handle_fatalError("trace key");
+}
+
+static TraceBuffer *trace_register() {
+    TraceBuffer *buffer;
+    // Take over the buffer of an exited thread, or map a new one.
+    for (buffer = __atomic_load_n(&trace_buffers, __ATOMIC_ACQUIRE); buffer != NULL; buffer = buffer->next) {
+        bool exited = true;
+        if (__atomic_compare_exchange_n(&buffer->exited, &exited, false, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            break;
+    }
+    if (buffer == NULL) {
+        // Not from emalloc, a traced allocation would come back here.
+        buffer = mmap(0, sizeof(TraceBuffer), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (buffer == MAP_FAILED)
+            handle_fatalError("trace buffer");
+        buffer->next = __atomic_load_n(&trace_buffers, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&trace_buffers, &buffer->next, buffer, true,
+                                            __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    }
+    // The buffer is given back when the thread exits.
+    trace_buffer = buffer;
+    trace_thread = syscall(SYS_gettid);
+    pthread_once(&trace_once, trace_create_key);
+    pthread_setspecific(trace_key, buffer);
+    return buffer;
+}
+
+void trace_event(unsigned char op, MemKind kind, unsigned long size, void *address, void *previous) {
+    TraceBuffer *buffer = trace_buffer;
+    if (buffer == NULL) {
+        buffer = trace_register();
+    }
+    unsigned long head = buffer->head;
+    if (head - __atomic_load_n(&buffer->tail, __ATOMIC_ACQUIRE) == TRACE_BUFFER_EVENTS) {
+        // Never wait for the flusher, the loss is counted in the header.
+        __atomic_add_fetch(&buffer->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    EmallocTraceEvent *event = &buffer->events[head % TRACE_BUFFER_EVENTS];
+    event->timestamp = trace_timestamp();
+    event->address = (unsigned long) address;
+    event->previous = (unsigned long) previous;
+    event->size = size;
+    event->thread = trace_thread;
+    event->op = op;
+    event->kind = kind;
+    event->reserved = 0;
+    __atomic_store_n(&buffer->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static void write_all(const void *data, unsigned long size) {
+    while (size > 0) {
+        ssize_t written = write(trace_fd, data, size);
+        if (written == -1) {
+            if (errno == EINTR)
+                continue;
+            // The trace is lost, the program goes on.
+            return;
+        }
+        data = (const char *) data + written;
+        size -= written;
+    }
+}
+
+static void trace_flush() {
+    for (TraceBuffer *buffer = __atomic_load_n(&trace_buffers, __ATOMIC_ACQUIRE); buffer != NULL; buffer = buffer->next) {
+        unsigned long tail = buffer->tail;
+        unsigned long head = __atomic_load_n(&buffer->head, __ATOMIC_ACQUIRE);
+        // The ring wraps at most once between tail and head.
+        while (tail != head) {
+            unsigned long start = tail % TRACE_BUFFER_EVENTS;
+            unsigned long nb_events = head - tail;
+            if (start + nb_events > TRACE_BUFFER_EVENTS)
+                nb_events = TRACE_BUFFER_EVENTS - start;
+            write_all(&buffer->events[start], nb_events * sizeof(EmallocTraceEvent));
+            tail += nb_events;
+        }
+        __atomic_store_n(&buffer->tail, tail, __ATOMIC_RELEASE);
+    }
+}
+
+static void *trace_flusher_main(void *unused) {
+    struct timespec period = {0, TRACE_FLUSH_PERIOD_NS};
+    while (!__atomic_load_n(&trace_stopping, __ATOMIC_ACQUIRE)) {
+        trace_flush();
+        nanosleep(&period, NULL);
+    }
+    return NULL;
+}
+
+int emalloc_trace_start(const char *path) {
+    if (options.tracing) {
+        errno = EBUSY;
+        return -1;
+    }
+    trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (trace_fd == -1)
+        return -1;
+    EmallocTraceHeader header = {EM_TRACE_MAGIC, sizeof(EmallocTraceEvent), 0};
+    write_all(&header, sizeof(header));
+    // Threads that were still appending when the last trace stopped left their
+    // events and drops in the buffers, they do not belong to this trace.
+    for (TraceBuffer *buffer = __atomic_load_n(&trace_buffers, __ATOMIC_ACQUIRE); buffer != NULL; buffer = buffer->next) {
+        __atomic_store_n(&buffer->tail, __atomic_load_n(&buffer->head, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+        __atomic_store_n(&buffer->dropped, 0, __ATOMIC_RELAXED);
+    }
+    trace_stopping = false;
+    int error = pthread_create(&trace_flusher, NULL, trace_flusher_main, NULL);
+    if (error != 0) {
+        close(trace_fd);
+        trace_fd = -1;
+        errno = error;
+        return -1;
+    }
+    __atomic_store_n(&options.tracing, true, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void emalloc_trace_stop(void) {
+    if (!options.tracing)
+        return;
+    __atomic_store_n(&options.tracing, false, __ATOMIC_RELEASE);
+    __atomic_store_n(&trace_stopping, true, __ATOMIC_RELEASE);
+    pthread_join(trace_flusher, NULL);
+    // Events appended since the last period.
+    trace_flush();
+    // The header is written again with the events lost.
+    unsigned long dropped = 0;
+    for (TraceBuffer *buffer = __atomic_load_n(&trace_buffers, __ATOMIC_ACQUIRE); buffer != NULL; buffer = buffer->next)
+        dropped += __atomic_load_n(&buffer->dropped, __ATOMIC_RELAXED);
+    EmallocTraceHeader header = {EM_TRACE_MAGIC, sizeof(EmallocTraceEvent), dropped < UINT_MAX ? dropped : UINT_MAX};
+    if (lseek(trace_fd, 0, SEEK_SET) == 0)
+        write_all(&header, sizeof(header));
+    close(trace_fd);
+    trace_fd = -1;
+}
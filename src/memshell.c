@@ -111,6 +111,11 @@ BLOCINFO bloc_info_table[NB_MAX_ALLOC];
 
 static void *zone_memoire;
 
+/*
+ * Arene des blocs alloues, NULL apres destroy
+ */
+static EArena *arene;
+
 /*
   ===============================================================================
   Fonctions
@@ -136,6 +141,40 @@ void used() {
 }
 
 
+/*
+ * Fonction d'affichage des statistiques de l'allocateur
+ */
+void show() {
+    if (arene == NULL) {
+        printf("Erreur : allocateur non initialisé\n");
+        return;
+    }
+    EmallocStats stats = earena_stats(arene);
+    static const char *kinds[3] = {"small", "medium", "large"};
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        printf("%-6s : %lu allocations, %lu libérations\n", kinds[i], stats.nb_alloc[i], stats.nb_free[i]);
+    }
+    printf("octets projetés : %lu, octets vivants : %lu\n", stats.mapped_bytes, stats.live_bytes);
+    for (i = 0; i < 4; i++) {
+        if (stats.small_chunks[i] != 0) {
+            printf("small %d octets : %lu/%lu chunks utilisés\n", 16 * (i + 1),
+                   stats.small_used[i], stats.small_chunks[i]);
+        }
+    }
+    for (i = 0; i < EM_STATS_ORDERS; i++) {
+        if (stats.free_blocks[i] != 0) {
+            printf("blocs libres de 2^%d octets : %lu\n", i, stats.free_blocks[i]);
+        }
+    }
+    if (stats.block_bytes != 0) {
+        printf("fragmentation interne : %.1f%%\n",
+               100.0 * (stats.block_bytes - stats.requested_bytes) / stats.block_bytes);
+    }
+}
+
+
 /*
  * Affichage de l'aide
  */
@@ -147,34 +186,56 @@ void help() {
     printf("\tretour : identificateur de bloc et adresse de départ de la zone\n");
     printf("3) free <identificateur> : libération d'un bloc\n");
     printf("4) destroy : libération de l'allocateur\n");
-    printf("4) show : affichage la taille initiale et de l'adresse de départ\n");
+    printf("4) show : affichage des statistiques de l'allocateur\n");
     printf("5) used : affichage de la liste des blocs occupés\n");
     printf("\tsous la forme {identificateur, adresse de départ, taille}\n");
     printf("6) help : affichage de ce manuel\n");
     printf("7) exit : quitter le shell\n");
 
     printf("\nRemarques :\n");
-    printf("1) Au lancement, le shell appelle mem_init\n");
+    printf("1) Au lancement, le shell crée une arène, destroy la libère avec tous ses blocs\n");
     printf("2) Le shell supporte jusqu'à %d allocations entre deux initialisations\n", NB_MAX_ALLOC);
 }
 
 
+/*
+ * Vide la table des infos, les blocs ne sont pas liberes
+ */
+void clear_table() {
+    int i;
+
+    id_count = 1;
+    for (i = 0; i < NB_MAX_ALLOC; i++) {
+        bloc_info_table[i].id = 0;
+        bloc_info_table[i].address = NULL;
+    }
+}
+
+/*
+ * (Re)initialisation de l'allocateur : une nouvelle arene remplace la
+ * precedente, dont tous les blocs sont liberes d'un coup
+ */
+void init_arene() {
+    if (arene != NULL) {
+        earena_destroy(arene);
+    }
+    arene = earena_create();
+    if (arene == NULL) {
+        printf("Erreur : échec de la création de l'arène\n");
+    }
+    clear_table();
+}
+
 /*
  * Initialisation de l'interpreteur
  */
 void init() {
 
-    int i;
-
     printf("**** Mini-shell de test pour l'allocateur mémoire ****\n");
     printf("\tTapez help pour la liste des commandes\n");
 
-    id_count = 1;
-
-    /* initialisation de la table des infos : */
-    for (i = 0; i < NB_MAX_ALLOC; i++) {
-        (bloc_info_table[i]).id = 0;
-    }
+    /* initialisation de l'allocateur et de la table des infos : */
+    init_arene();
 
     printf("\n");
 }
@@ -381,12 +442,11 @@ int main() {
         switch (cmd) {
 
             case INIT:
-
-                printf("!!! Pas implanté dans ce sujet !!!\n");
+                init_arene();
                 break;
 
             case SHOW:
-                printf("!!! Pas implanté dans ce sujet !!! Utilisez un débogueur !!!\n");
+                show();
                 break;
 
             case USED:
@@ -395,7 +455,11 @@ int main() {
 
             case ALLOC:
 
-                res = emalloc(args.size);
+                if (arene == NULL) {
+                    printf("Erreur : allocateur non initialisé\n");
+                    break;
+                }
+                res = earena_alloc(arene, args.size);
                 /* si une erreur a lieu, on affiche 0 */
                 if (res == NULL) {
                     printf("Erreur : échec de l'allocation (fonction emalloc, retour=NULL)\n");
@@ -405,7 +469,7 @@ int main() {
                         /* s'il ne reste pas d'id libre
                            on affiche 0 et on libere le bloc */
                         printf("Erreur : nombre maximum d'allocations atteint/n");
-                        efree(res);
+                        earena_free(arene, res);
                     } else { /* pas de probleme, affichage de la zone allouée */
                         printf("%ld 0x%lX\n", id, (unsigned long) (res - (void *) zone_memoire));
                     }
@@ -414,7 +478,12 @@ int main() {
 
 
             case DESTROY:
-                printf("!!! Pas implanté dans ce sujet !!!\n");
+                /* tous les blocs disparaissent avec l'arene */
+                if (arene != NULL) {
+                    earena_destroy(arene);
+                    arene = NULL;
+                }
+                clear_table();
                 break;
 
             case FREE:
@@ -426,7 +495,7 @@ int main() {
 
 
                     /* liberation du bloc concerne */
-                    efree(addr);
+                    earena_free(arene, addr);
 
                     /* liberation de l'id */
                     remove_id(args.id);
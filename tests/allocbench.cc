@@ -0,0 +1,47 @@
+/******************************************************
+ * Copyright Grégory Mounié 2008-2018                 *
+ * This code is distributed under the GLPv3+ licence. *
+ * Ce code est distribué sous la licence GPLv3+.      *
+ ******************************************************/
+
+#include <chrono>
+#include <cstdio>
+#include <string>
+
+#include "bench.h"
+
+using namespace std;
+
+constexpr int NB_RUNS = 5;
+
+vector<Bench> &benches() {
+    static vector<Bench> all;
+    return all;
+}
+
+/*
+ * allocbench [filter]: run every benchmark whose "group.name" contains filter,
+ * and print the best time per operation over NB_RUNS runs.
+ */
+int main(int argc, char **argv) {
+    const char *filter = argc > 1 ? argv[1] : "";
+
+    printf("%-32s %12s %10s\n", "benchmark", "ops", "ns/op");
+    for (auto &b: benches()) {
+        string name = string(b.group) + "." + b.name;
+        if (name.find(filter) == string::npos)
+            continue;
+        double best = 0;
+        unsigned long ops = 0;
+        for (int i = 0; i < NB_RUNS; i++) {
+            auto start = chrono::steady_clock::now();
+            ops = b.run();
+            chrono::duration<double, nano> elapsed = chrono::steady_clock::now() - start;
+            double per_op = elapsed.count() / ops;
+            if (i == 0 || per_op < best)
+                best = per_op;
+        }
+        printf("%-32s %12lu %10.1f\n", name.c_str(), ops, best);
+    }
+    return 0;
+}
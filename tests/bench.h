@@ -0,0 +1,37 @@
+/******************************************************
+ * Copyright Grégory Mounié 2008-2018                 *
+ * This code is distributed under the GLPv3+ licence. *
+ * Ce code est distribué sous la licence GPLv3+.      *
+ ******************************************************/
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <vector>
+
+/*
+ * A benchmark runs its scenario once and returns the number of operations
+ * it did, allocbench times it and reports the cost of one operation.
+ */
+struct Bench {
+    const char *group;
+    const char *name;
+
+    unsigned long (*run)();
+};
+
+std::vector<Bench> &benches();
+
+struct BenchRegistration {
+    BenchRegistration(const char *group, const char *name, unsigned long (*run)()) {
+        benches().push_back({group, name, run});
+    }
+};
+
+#define BENCH(group, name)                                                   \
+    static unsigned long bench_##group##_##name();                          \
+    static BenchRegistration registration_##group##_##name(#group, #name,   \
+                                                           bench_##group##_##name); \
+    static unsigned long bench_##group##_##name()
+
+#endif
@@ -0,0 +1,47 @@
+/******************************************************
+ * Copyright Grégory Mounié 2008-2018                 *
+ * This code is distributed under the GLPv3+ licence. *
+ * Ce code est distribué sous la licence GPLv3+.      *
+ ******************************************************/
+
+#include <vector>
+
+#include "../src/mem.h"
+#include "../src/mem_internals.h"
+
+#include "bench.h"
+
+using namespace std;
+
+constexpr int NB_OPS = 1000000;
+constexpr unsigned long AREA_SIZE = 128;
+constexpr int NB_AREAS = 1024;
+
+// Mark an area as an allocation would and check it as a free would, without the
+// cost of the allocator around it.
+static unsigned long markcheck(int level) {
+    vector<char> buffer(NB_AREAS * AREA_SIZE);
+    unsigned long sizes = 0;
+    // The level the library runs with, whatever it was built or set to.
+    int saved_level = options.check_level;
+
+    emallopt(EM_CHECK_LEVEL, level);
+    for (int i = 0; i < NB_OPS; i++) {
+        void *ptr = mark_memarea_and_get_user_ptr(&buffer[(i % NB_AREAS) * AREA_SIZE], AREA_SIZE, MEDIUM_KIND);
+        sizes += mark_check_and_get_alloc(ptr).size;
+    }
+    emallopt(EM_CHECK_LEVEL, saved_level);
+    return sizes / AREA_SIZE;
+}
+
+BENCH(Check, off) {
+    return markcheck(EM_CHECK_OFF);
+}
+
+BENCH(Check, canary) {
+    return markcheck(EM_CHECK_CANARY);
+}
+
+BENCH(Check, full) {
+    return markcheck(EM_CHECK_FULL);
+}
@@ -0,0 +1,25 @@
+/******************************************************
+ * Copyright Grégory Mounié 2008-2018                 *
+ * This code is distributed under the GLPv3+ licence. *
+ * Ce code est distribué sous la licence GPLv3+.      *
+ ******************************************************/
+
+#include <cstring>
+
+#include "../src/mem.h"
+#include "../src/mem_internals.h"
+
+#include "bench.h"
+
+constexpr int NB_OPS = 20000;
+
+// Request buffers of a few sizes, allocated, touched and freed in turn.
+BENCH(Large, bufferchurn) {
+    for (int i = 0; i < NB_OPS; i++) {
+        unsigned long size = LARGEALLOC << (i % 3);
+        char *ptr = (char *) emalloc(size);
+        ptr[0] = ptr[size - 1] = 1;
+        efree(ptr);
+    }
+    return NB_OPS;
+}
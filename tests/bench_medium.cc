@@ -0,0 +1,72 @@
+/******************************************************
+ * Copyright Grégory Mounié 2008-2018                 *
+ * This code is distributed under the GLPv3+ licence. *
+ * Ce code est distribué sous la licence GPLv3+.      *
+ ******************************************************/
+
+#include <cstring>
+#include <vector>
+
+#include "../src/mem.h"
+#include "../src/mem_internals.h"
+
+#include "bench.h"
+
+using namespace std;
+
+constexpr int NB_OPS = 200000;
+
+// Smallest block out of a free arena: the search climbs every empty order.
+BENCH(Medium, allocfree) {
+    for (int i = 0; i < NB_OPS; i++)
+        efree(emalloc(SMALLALLOC + 1));
+    return NB_OPS;
+}
+
+// Alternate sizes so that several orders stay populated.
+BENCH(Medium, allocmixed) {
+    constexpr int NB_LIVE = 1024;
+    vector<void *> live(NB_LIVE);
+
+    for (int i = 0; i < NB_OPS; i++) {
+        void *&slot = live[i % NB_LIVE];
+        if (slot)
+            efree(slot);
+        slot = emalloc(SMALLALLOC + 1 + (i * 97) % (16 * 1024));
+    }
+    for (auto p: live)
+        efree(p);
+    return NB_OPS;
+}
+
+// Only one block of each order is free: a long allocation run keeps splitting.
+BENCH(Medium, allocrun) {
+    constexpr int NB_LIVE = 4096;
+    vector<void *> live(NB_LIVE);
+    unsigned long ops = 0;
+
+    for (int i = 0; i < NB_OPS / NB_LIVE; i++) {
+        for (auto &p: live)
+            p = emalloc(SMALLALLOC + 1);
+        for (auto p: live)
+            efree(p);
+        ops += NB_LIVE;
+    }
+    return ops;
+}
+
+// Same as allocrun, the blocks are freed with their size.
+BENCH(Medium, sizedrun) {
+    constexpr int NB_LIVE = 4096;
+    vector<void *> live(NB_LIVE);
+    unsigned long ops = 0;
+
+    for (int i = 0; i < NB_OPS / NB_LIVE; i++) {
+        for (auto &p: live)
+            p = emalloc(SMALLALLOC + 1);
+        for (auto p: live)
+            efree_sized(p, SMALLALLOC + 1);
+        ops += NB_LIVE;
+    }
+    return ops;
+}
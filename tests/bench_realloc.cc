@@ -0,0 +1,46 @@
+/******************************************************
+ * Copyright Grégory Mounié 2008-2018                 *
+ * This code is distributed under the GLPv3+ licence. *
+ * Ce code est distribué sous la licence GPLv3+.      *
+ ******************************************************/
+
+#include <cstring>
+
+#include "../src/mem.h"
+#include "../src/mem_internals.h"
+
+#include "bench.h"
+
+constexpr unsigned long APPEND_STEP = 256;
+constexpr unsigned long APPEND_MAX = 4 * 1024 * 1024;
+
+// A buffer growing by small appends, resized with erealloc.
+BENCH(Realloc, append) {
+    char *buffer = nullptr;
+    unsigned long ops = 0;
+
+    for (unsigned long size = APPEND_STEP; size <= APPEND_MAX; size += APPEND_STEP, ops++) {
+        buffer = (char *) erealloc(buffer, size);
+        memset(buffer + size - APPEND_STEP, 1, APPEND_STEP);
+    }
+    efree(buffer);
+    return ops;
+}
+
+// The same buffer moved by hand at every append: allocate, copy, free.
+BENCH(Realloc, appendcopy) {
+    char *buffer = nullptr;
+    unsigned long ops = 0;
+
+    for (unsigned long size = APPEND_STEP; size <= APPEND_MAX; size += APPEND_STEP, ops++) {
+        char *bigger = (char *) emalloc(size);
+        if (buffer) {
+            memcpy(bigger, buffer, size - APPEND_STEP);
+            efree(buffer);
+        }
+        buffer = bigger;
+        memset(buffer + size - APPEND_STEP, 1, APPEND_STEP);
+    }
+    efree(buffer);
+    return ops;
+}
@@ -0,0 +1,77 @@
+/******************************************************
+ * Copyright Grégory Mounié 2008-2018                 *
+ * This code is distributed under the GLPv3+ licence. *
+ * Ce code est distribué sous la licence GPLv3+.      *
+ ******************************************************/
+
+#include <cstring>
+#include <vector>
+
+#include "../src/mem.h"
+
+#include "bench.h"
+
+using namespace std;
+
+constexpr int NB_REQUESTS = 200;
+constexpr int NB_NODES = 5000;
+
+/*
+ * A parser building the tree of each request: nodes of a few words, names of
+ * a few bytes and, now and then, a larger buffer, all dropped with the request.
+ */
+static unsigned long node_size(int i) {
+    switch (i % 8) {
+        case 0:
+            return 8 + i % 24;
+        case 7:
+            return i % 64 == 7 ? 1024 : 40;
+        default:
+            return 32;
+    }
+}
+
+BENCH(Region, parse) {
+    ERegion *r = eregion_create();
+    for (int i = 0; i < NB_REQUESTS; i++) {
+        ERegionMark mark = eregion_mark(r);
+        for (int j = 0; j < NB_NODES; j++)
+            *(volatile char *) eregion_alloc(r, node_size(j)) = 1;
+        eregion_release(r, mark);
+    }
+    eregion_destroy(r);
+    return (unsigned long) NB_REQUESTS * NB_NODES;
+}
+
+// The same requests with emalloc, every object is freed on its own.
+BENCH(Region, parseemalloc) {
+    vector<void *> nodes(NB_NODES);
+    for (int i = 0; i < NB_REQUESTS; i++) {
+        for (int j = 0; j < NB_NODES; j++) {
+            nodes[j] = emalloc(node_size(j));
+            *(volatile char *) nodes[j] = 1;
+        }
+        for (auto p: nodes)
+            efree(p);
+    }
+    return (unsigned long) NB_REQUESTS * NB_NODES;
+}
+
+// Nested scopes: a mark per statement inside the mark of the request.
+BENCH(Region, parsenested) {
+    ERegion *r = eregion_create();
+    for (int i = 0; i < NB_REQUESTS; i++) {
+        ERegionMark request = eregion_mark(r);
+        for (int j = 0; j < NB_NODES; j += 50) {
+            ERegionMark statement = eregion_mark(r);
+            for (int k = 0; k < 50; k++)
+                *(volatile char *) eregion_alloc(r, node_size(j + k)) = 1;
+            // Half of the statements are kept until the end of the request.
+            if (j % 100 == 0)
+                eregion_release(r, statement);
+        }
+        eregion_release(r, request);
+    }
+    eregion_destroy(r);
+    return (unsigned long) NB_REQUESTS * NB_NODES;
+}
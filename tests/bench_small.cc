@@ -0,0 +1,80 @@
+/******************************************************
+ * Copyright Grégory Mounié 2008-2018                 *
+ * This code is distributed under the GLPv3+ licence. *
+ * Ce code est distribué sous la licence GPLv3+.      *
+ ******************************************************/
+
+#include <thread>
+#include <vector>
+
+#include "../src/mem.h"
+#include "../src/mem_internals.h"
+
+#include "bench.h"
+
+using namespace std;
+
+constexpr int NB_OPS = 1000000;
+
+// The same chunk goes back and forth to its pool.
+BENCH(Small, allocfree) {
+    for (int i = 0; i < NB_OPS; i++)
+        efree(emalloc(SMALLALLOC));
+    return NB_OPS;
+}
+
+// Many live objects of every class, the footprint matters.
+BENCH(Small, allocrun) {
+    constexpr int NB_LIVE = 16384;
+    vector<void *> live(NB_LIVE);
+    unsigned long ops = 0;
+
+    for (int i = 0; i < NB_OPS / NB_LIVE; i++) {
+        for (int j = 0; j < NB_LIVE; j++)
+            live[j] = emalloc(1 + j % SMALLALLOC);
+        for (auto p: live)
+            efree(p);
+        ops += NB_LIVE;
+    }
+    return ops;
+}
+
+// Same as allocrun, each class is allocated and freed in batches.
+BENCH(Small, batchrun) {
+    constexpr int NB_LIVE = 16384;
+    constexpr int NB_PER_CLASS = NB_LIVE / SMALL_CLASSES;
+    vector<void *> live(NB_LIVE);
+    unsigned long ops = 0;
+
+    for (int i = 0; i < NB_OPS / NB_LIVE; i++) {
+        for (int c = 0; c < SMALL_CLASSES; c++)
+            emalloc_batch(SMALL_CHUNKSIZE(c), NB_PER_CLASS, &live[c * NB_PER_CLASS]);
+        efree_batch(live.data(), NB_LIVE);
+        ops += NB_LIVE;
+    }
+    return ops;
+}
+
+// Threads allocating more than their caches hold, the runs go through the shared pools.
+BENCH(Small, threadedrun) {
+    constexpr int NB_THREADS = 4;
+    constexpr int NB_LIVE = 1024;
+    vector<thread> threads;
+
+    emallopt(EM_THREADED, 1);
+    for (int t = 0; t < NB_THREADS; t++) {
+        threads.emplace_back([] {
+            vector<void *> live(NB_LIVE);
+            for (int i = 0; i < NB_OPS / NB_THREADS / NB_LIVE; i++) {
+                for (auto &p: live)
+                    p = emalloc(SMALLALLOC);
+                for (auto p: live)
+                    efree(p);
+            }
+        });
+    }
+    for (auto &t: threads)
+        t.join();
+    emallopt(EM_THREADED, 0);
+    return NB_OPS / NB_LIVE * NB_LIVE;
+}
@@ -0,0 +1,57 @@
+/******************************************************
+ * Copyright Grégory Mounié 2008-2018                 *
+ * This code is distributed under the GLPv3+ licence. *
+ * Ce code est distribué sous la licence GPLv3+.      *
+ ******************************************************/
+
+#include <thread>
+#include <vector>
+
+#include "../src/mem.h"
+#include "../src/mem_internals.h"
+
+#include "bench.h"
+
+using namespace std;
+
+/*
+ * Thread scaling: every thread does the same work, the time per operation is the
+ * wall time over the operations of all of them. It is divided by the number of
+ * threads when the throughput scales linearly, as long as there are as many cores.
+ */
+static unsigned long scaling(unsigned long size, int nb_threads, int nb_ops) {
+    constexpr int NB_LIVE = 64;
+    vector<thread> threads;
+
+    emallopt(EM_THREADED, 1);
+    for (int t = 0; t < nb_threads; t++) {
+        threads.emplace_back([size, nb_ops] {
+            vector<void *> live(NB_LIVE);
+            for (int i = 0; i < nb_ops / NB_LIVE; i++) {
+                for (auto &p: live)
+                    p = emalloc(size);
+                for (auto p: live)
+                    efree(p);
+            }
+        });
+    }
+    for (auto &t: threads)
+        t.join();
+    emallopt(EM_THREADED, 0);
+    return (unsigned long) nb_threads * (nb_ops / NB_LIVE * NB_LIVE);
+}
+
+#define SCALING(kind, size, nb_ops)                                   \
+    BENCH(Scaling, kind##_1) { return scaling(size, 1, nb_ops); }     \
+    BENCH(Scaling, kind##_2) { return scaling(size, 2, nb_ops); }     \
+    BENCH(Scaling, kind##_4) { return scaling(size, 4, nb_ops); }     \
+    BENCH(Scaling, kind##_8) { return scaling(size, 8, nb_ops); }     \
+    BENCH(Scaling, kind##_16) { return scaling(size, 16, nb_ops); }   \
+    BENCH(Scaling, kind##_32) { return scaling(size, 32, nb_ops); }
+
+// Small chunks and buddy medium blocks stay in the thread caches, large segments
+// go through the shared segment cache under the arena lock. With the TLSF engine
+// every medium operation takes the arena lock.
+SCALING(small, SMALLALLOC, 200000)
+SCALING(medium, 1000, 100000)
+SCALING(large, 2 * LARGEALLOC, 5000)
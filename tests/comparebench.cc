@@ -0,0 +1,251 @@
+/******************************************************
+ * Copyright Grégory Mounié 2008-2018                 *
+ * This code is distributed under the GLPv3+ licence. *
+ * Ce code est distribué sous la licence GPLv3+.      *
+ ******************************************************/
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <random>
+#include <algorithm>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#include "test_run.H"
+
+using namespace std;
+
+constexpr int NB_RUNS = 5;
+
+struct Allocator {
+    const char *name;
+
+    void *(*alloc)(unsigned long);
+
+    void (*free)(void *);
+
+    // engine of the medium allocations of emalloc, -1 for other allocators
+    int medium_engine;
+};
+
+static const Allocator allocators[] = {
+        {"emalloc",      emalloc, efree, EM_MEDIUM_BUDDY},
+        {"emalloc-tlsf", emalloc, efree, EM_MEDIUM_TLSF},
+        {"glibc",        malloc,  free,  -1},
+};
+
+// Every allocation is written once, as a program would.
+static void *touch(void *ptr) {
+    *(volatile char *) ptr = 1;
+    return ptr;
+}
+
+// Small objects freed in the reverse order of their allocation.
+static unsigned long lifo(const Allocator &a) {
+    constexpr int DEPTH = 64;
+    constexpr int NB_LOOPS = 16384;
+    void *stack[DEPTH];
+
+    for (int i = 0; i < NB_LOOPS; i++) {
+        for (int j = 0; j < DEPTH; j++)
+            stack[j] = touch(a.alloc(1 + j % SMALLALLOC));
+        for (int j = DEPTH - 1; j >= 0; j--)
+            a.free(stack[j]);
+    }
+    return 2UL * DEPTH * NB_LOOPS;
+}
+
+// The oldest object is freed for each new one, the sizes cross the small boundary.
+static unsigned long fifo(const Allocator &a) {
+    constexpr int NB_LIVE = 4096;
+    constexpr int NB_OPS = 1000000;
+    vector<void *> queue(NB_LIVE);
+
+    for (int i = 0; i < NB_LIVE; i++)
+        queue[i] = touch(a.alloc(16 + i % 256));
+    for (int i = 0; i < NB_OPS; i++) {
+        a.free(queue[i % NB_LIVE]);
+        queue[i % NB_LIVE] = touch(a.alloc(16 + (i * 7) % 256));
+    }
+    for (auto p: queue)
+        a.free(p);
+    return 2UL * (NB_LIVE + NB_OPS);
+}
+
+// Random sizes around 64 B, in the medium range and around 128 KiB.
+static unsigned long churn(const Allocator &a) {
+    constexpr int NB_LIVE = 4096;
+    constexpr int NB_OPS = 200000;
+    vector<void *> live(NB_LIVE);
+    mt19937_64 gen(1);
+    unsigned long ops = 0;
+
+    for (int i = 0; i < NB_OPS; i++) {
+        void *&slot = live[gen() % NB_LIVE];
+        if (slot) {
+            a.free(slot);
+            ops++;
+        }
+        unsigned long size;
+        switch (gen() % 3) {
+            case 0:
+                size = SMALLALLOC / 2 + gen() % SMALLALLOC;
+                break;
+            case 1:
+                size = 1024 + gen() % (16 * 1024);
+                break;
+            default:
+                size = LARGEALLOC - 8 * 1024 + gen() % (16 * 1024);
+        }
+        slot = touch(a.alloc(size));
+        ops++;
+    }
+    for (auto p: live)
+        if (p)
+            a.free(p);
+    return ops;
+}
+
+// Medium sizes spread evenly over the powers of two, most are far from one.
+static unsigned long medium(const Allocator &a) {
+    constexpr int NB_LIVE = 2048;
+    constexpr int NB_OPS = 200000;
+    vector<void *> live(NB_LIVE);
+    mt19937_64 gen(2);
+    unsigned long ops = 0;
+
+    for (int i = 0; i < NB_OPS; i++) {
+        void *&slot = live[gen() % NB_LIVE];
+        if (slot) {
+            a.free(slot);
+            ops++;
+        }
+        unsigned int order = 7 + gen() % 10;
+        unsigned long size = (1UL << order) + gen() % (1UL << order);
+        slot = touch(a.alloc(size));
+        ops++;
+    }
+    for (auto p: live)
+        if (p)
+            a.free(p);
+    return ops;
+}
+
+// The allocations of random_run_cpp, freed in a random order.
+static unsigned long fibo(const Allocator &a) {
+    constexpr int NB_LOOPS = 20;
+    vector<allocat> list;
+    fillList_fibo<FIRST_ALLOC_MEDIUM * 16>(list);
+    vector<void *> live(list.size());
+    mt19937_64 gen;
+
+    for (int i = 0; i < NB_LOOPS; i++) {
+        for (unsigned long j = 0; j < list.size(); j++)
+            live[j] = touch(a.alloc(list[j].size));
+        shuffle(live.begin(), live.end(), gen);
+        for (auto p: live)
+            a.free(p);
+    }
+    return 2UL * NB_LOOPS * list.size();
+}
+
+struct Scenario {
+    const char *name;
+
+    unsigned long (*run)(const Allocator &);
+};
+
+static const Scenario scenarios[] = {
+        {"lifo",  lifo},
+        {"fifo",  fifo},
+        {"churn", churn},
+        {"medium", medium},
+        {"fibo",  fibo},
+};
+
+struct Result {
+    double ns_per_op;
+    // share of the block bytes that were not requested, emalloc only
+    double waste;
+    long peak_rss;
+};
+
+/*
+ * Each scenario runs in its own process, which gives its peak RSS and keeps
+ * the state left by one allocator out of the next measure.
+ */
+static Result measure(const Scenario &s, const Allocator &a) {
+    int fds[2];
+    Result result = {0, -1, 0};
+
+    if (pipe(fds) == -1) {
+        perror("comparebench");
+        exit(EXIT_FAILURE);
+    }
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("comparebench");
+        exit(EXIT_FAILURE);
+    }
+    if (pid == 0) {
+        close(fds[0]);
+        if (a.medium_engine >= 0 && !emallopt(EM_MEDIUM_ENGINE, a.medium_engine))
+            _exit(EXIT_FAILURE);
+        double best = 0;
+        for (int i = 0; i < NB_RUNS; i++) {
+            auto start = chrono::steady_clock::now();
+            unsigned long ops = s.run(a);
+            chrono::duration<double, nano> elapsed = chrono::steady_clock::now() - start;
+            double per_op = elapsed.count() / ops;
+            if (i == 0 || per_op < best)
+                best = per_op;
+        }
+        Result measured = {best, -1, 0};
+        if (a.medium_engine >= 0) {
+            EmallocStats stats = emalloc_stats();
+            measured.waste = 1.0 - (double) stats.requested_bytes / stats.block_bytes;
+        }
+        bool written = write(fds[1], &measured, sizeof(measured)) == sizeof(measured);
+        _exit(written ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+    close(fds[1]);
+    if (read(fds[0], &result, sizeof(result)) != sizeof(result))
+        result.ns_per_op = -1;
+    close(fds[0]);
+    int status;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+        fprintf(stderr, "comparebench: %s with %s failed\n", s.name, a.name);
+        exit(EXIT_FAILURE);
+    }
+    result.peak_rss = usage.ru_maxrss;
+    return result;
+}
+
+/*
+ * comparebench [filter]: run every scenario whose name contains filter with
+ * emalloc and its buddy medium engine, emalloc and its TLSF medium engine, then
+ * glibc. Print for each the best time per operation over NB_RUNS runs, the peak
+ * RSS and, for emalloc, the share of the block bytes that were not requested.
+ */
+int main(int argc, char **argv) {
+    const char *filter = argc > 1 ? argv[1] : "";
+
+    printf("%-12s %-14s %10s %12s %8s\n", "scenario", "allocator", "ns/op", "RSS KiB", "waste");
+    for (auto &s: scenarios) {
+        if (string(s.name).find(filter) == string::npos)
+            continue;
+        for (auto &a: allocators) {
+            Result r = measure(s, a);
+            if (r.waste < 0)
+                printf("%-12s %-14s %10.1f %12ld %8s\n", s.name, a.name, r.ns_per_op, r.peak_rss, "-");
+            else
+                printf("%-12s %-14s %10.1f %12ld %7.1f%%\n", s.name, a.name, r.ns_per_op, r.peak_rss,
+                       100 * r.waste);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,94 @@
+/******************************************************
+ * Copyright Grégory Mounié 2008-2018                 *
+ * This code is distributed under the GLPv3+ licence. *
+ * Ce code est distribué sous la licence GPLv3+.      *
+ ******************************************************/
+
+#include <gtest/gtest.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+
+#include "../src/mem.h"
+#include "../src/mem_internals.h"
+
+using namespace std;
+
+TEST(Aligned, invalid) {
+    void *ptr = (void *) 1;
+
+    ASSERT_EQ(ealigned_alloc(48, 10), nullptr);
+    ASSERT_EQ(ealigned_alloc(0, 10), nullptr);
+    ASSERT_EQ(ealigned_alloc(64, 0), nullptr);
+    ASSERT_EQ(eposix_memalign(&ptr, 4, 10), EINVAL);
+    ASSERT_EQ(eposix_memalign(&ptr, 24, 10), EINVAL);
+    ASSERT_EQ(eposix_memalign(&ptr, 64, 0), 0);
+    ASSERT_EQ(ptr, nullptr);
+}
+
+TEST(Aligned, allkinds) {
+    for (unsigned long alignment = 8; alignment <= (1UL << 21); alignment <<= 1) {
+        vector<void *> tab;
+        for (unsigned long size: {1UL, 64UL, 100UL, 1000UL, 60000UL, 100000UL, 3UL * LARGEALLOC}) {
+            void *ptr = nullptr;
+            ASSERT_EQ(eposix_memalign(&ptr, alignment, size), 0);
+            ASSERT_EQ((unsigned long) ptr % alignment, 0UL) << alignment << " " << size;
+            memset(ptr, 1, size);
+            tab.push_back(ptr);
+        }
+        for (auto t: tab)
+            efree(t);
+    }
+}
+
+TEST(Aligned, mediummark) {
+    if (arena.medium_engine != EM_MEDIUM_BUDDY)
+        GTEST_SKIP() << "TLSF blocks are cut at the aligned place";
+    // The mark is right before the aligned address, the block holds the lead up to it.
+    char *ptr = (char *) ealigned_alloc(64, 128);
+    Alloc a = mark_check_and_get_alloc(ptr);
+    ASSERT_EQ(a.kind, MEDIUM_KIND);
+    ASSERT_EQ(ptr - (char *) a.ptr, 64L);
+    ASSERT_EQ((unsigned long) a.ptr % 256, 0UL);
+    ASSERT_EQ(a.size, 48UL + 128UL + 32UL);
+    ASSERT_EQ(emalloc_usable_size(ptr), 128UL);
+    // The whole block goes back on free, the next one of its order is the same.
+    efree(ptr);
+    void *again = ealigned_alloc(256, 100);
+    ASSERT_EQ((char *) again - 256, a.ptr);
+    efree(again);
+    // Marked allocations have no lead.
+    char *marked = (char *) emalloc(1000);
+    ASSERT_EQ((char *) mark_check_and_get_alloc(marked).ptr, marked - 16);
+    efree(marked);
+}
+
+TEST(Aligned, realloc) {
+    for (unsigned long size: {1000UL, 3UL * LARGEALLOC}) {
+        void *ptr = ealigned_alloc(256, size);
+        memset(ptr, 7, size);
+        void *ptr2 = erealloc(ptr, 2 * size);
+        for (unsigned long i = 0; i < size; i++)
+            ASSERT_EQ(((unsigned char *) ptr2)[i], 7);
+        efree(ptr2);
+    }
+}
+
+TEST(Aligned, largesegment) {
+    // The mark is right before the first aligned offset, only that offset is added to the segment.
+    ASSERT_EQ(emallopt(EM_LARGE_CACHE_MAX, 0), 1);
+    unsigned long page_size = sysconf(_SC_PAGESIZE);
+    for (unsigned long alignment: {32UL, 256UL, 1024UL, page_size}) {
+        unsigned long size = 3UL * LARGEALLOC - 100;
+        EmallocStats before = emalloc_stats();
+        void *ptr = ealigned_alloc(alignment, size);
+        EmallocStats during = emalloc_stats();
+        ASSERT_EQ((unsigned long) ptr % alignment, 0UL);
+        ASSERT_EQ((unsigned long) ptr % page_size, alignment % page_size);
+        unsigned long segment = (alignment + size + 16 + page_size - 1) & ~(page_size - 1);
+        ASSERT_EQ(during.block_bytes - before.block_bytes, segment) << alignment;
+        efree(ptr);
+    }
+    ASSERT_EQ(emallopt(EM_LARGE_CACHE_MAX, DEFAULT_LARGE_CACHE_MAX), 1);
+}
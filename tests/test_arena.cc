@@ -0,0 +1,87 @@
+/******************************************************
+ * Copyright Grégory Mounié 2008-2018                 *
+ * This code is distributed under the GLPv3+ licence. *
+ * Ce code est distribué sous la licence GPLv3+.      *
+ ******************************************************/
+
+#include <gtest/gtest.h>
+#include <string.h>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "../src/mem.h"
+#include "../src/mem_internals.h"
+
+using namespace std;
+
+static const unsigned long sizes[] = {8, 64, 65, 1000, 40000, LARGEALLOC - 1, LARGEALLOC, 5 * LARGEALLOC};
+
+static unsigned int nb_mappings() {
+    ifstream maps("/proc/self/maps");
+    string line;
+    unsigned int nb = 0;
+    while (getline(maps, line))
+        nb++;
+    return nb;
+}
+
+TEST(Arena, destroy) {
+    nb_mappings();
+    unsigned int before = nb_mappings();
+    EArena *a = earena_create();
+    ASSERT_NE(a, nullptr);
+    // Some allocations are freed, the others are left to the destroy.
+    for (int round = 0; round < 4; round++) {
+        for (unsigned long size: sizes) {
+            void *ptr = earena_alloc(a, size);
+            memset(ptr, round, size);
+            if (round % 2 == 0)
+                earena_free(a, ptr);
+        }
+    }
+    EmallocStats stats = earena_stats(a);
+    for (int kind = SMALL_KIND; kind <= LARGE_KIND; kind++)
+        ASSERT_GT(stats.nb_alloc[kind], stats.nb_free[kind]);
+    ASSERT_GT(stats.mapped_bytes, 0UL);
+    ASSERT_GT(nb_mappings(), before);
+    earena_destroy(a);
+    ASSERT_EQ(nb_mappings(), before);
+}
+
+TEST(Arena, independent) {
+    EmallocStats main_before = emalloc_stats();
+    EArena *a = earena_create();
+    EArena *b = earena_create();
+    vector<void *> in_a, in_b;
+    for (unsigned long size: sizes) {
+        in_a.push_back(earena_alloc(a, size));
+        in_b.push_back(earena_alloc(b, size));
+        memset(in_a.back(), 'a', size);
+        memset(in_b.back(), 'b', size);
+    }
+    // The main arena did not see them.
+    EmallocStats main_after = emalloc_stats();
+    for (int kind = SMALL_KIND; kind <= LARGE_KIND; kind++)
+        ASSERT_EQ(main_after.nb_alloc[kind], main_before.nb_alloc[kind]);
+    earena_destroy(a);
+    for (unsigned long i = 0; i < in_b.size(); i++)
+        for (unsigned long j = 0; j < sizes[i]; j += 4096)
+            ASSERT_EQ(((char *) in_b[i])[j], 'b');
+    for (auto p: in_b)
+        earena_free(b, p);
+    EmallocStats stats = earena_stats(b);
+    ASSERT_EQ(stats.live_bytes, 0UL);
+    earena_destroy(b);
+}
+
+TEST(Arena, reuse) {
+    // Freed blocks are reused within their arena.
+    EArena *a = earena_create();
+    for (unsigned long size: sizes) {
+        void *ptr = earena_alloc(a, size);
+        earena_free(a, ptr);
+        ASSERT_EQ(earena_alloc(a, size), ptr) << size;
+    }
+    earena_destroy(a);
+}
@@ -0,0 +1,112 @@
+/******************************************************
+ * Copyright Grégory Mounié 2008-2018                 *
+ * This code is distributed under the GLPv3+ licence. *
+ * Ce code est distribué sous la licence GPLv3+.      *
+ ******************************************************/
+
+#include <gtest/gtest.h>
+#include <string.h>
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+#include "../src/mem.h"
+#include "../src/mem_internals.h"
+
+using namespace std;
+
+// The allocations must not overlap, each one is filled with its index.
+static void fill_and_check(vector<void *> &ptrs, unsigned long size) {
+    for (unsigned long i = 0; i < ptrs.size(); i++)
+        memset(ptrs[i], i, size);
+    for (unsigned long i = 0; i < ptrs.size(); i++) {
+        bool intact = true;
+        for (unsigned long j = 0; j < size; j++)
+            intact &= ((unsigned char *) ptrs[i])[j] == (unsigned char) i;
+        ASSERT_TRUE(intact) << i;
+    }
+}
+
+TEST(Batch, zero) {
+    void *ptrs[4] = {&ptrs, &ptrs, &ptrs, &ptrs};
+    ASSERT_EQ(emalloc_batch(0, 4, ptrs), 0UL);
+    for (auto p: ptrs)
+        ASSERT_EQ(p, nullptr);
+    efree_batch(ptrs, 4);
+}
+
+TEST(Batch, allkinds) {
+    for (unsigned long size: {1UL, 48UL, SMALLALLOC + 1UL, 1000UL, 40000UL, LARGEALLOC - 1UL, 2UL * LARGEALLOC}) {
+        for (unsigned long n: {1UL, 7UL, 300UL}) {
+            if (size >= LARGEALLOC && n > 7)
+                continue;
+            EmallocStats before = emalloc_stats();
+            vector<void *> ptrs(n);
+            ASSERT_EQ(emalloc_batch(size, n, ptrs.data()), n);
+            fill_and_check(ptrs, size);
+            for (auto p: ptrs)
+                ASSERT_GE(emalloc_usable_size(p), size);
+            EmallocStats during = emalloc_stats();
+            MemKind kind = size <= SMALLALLOC ? SMALL_KIND : size < LARGEALLOC ? MEDIUM_KIND : LARGE_KIND;
+            ASSERT_EQ(during.nb_alloc[kind], before.nb_alloc[kind] + n);
+            ASSERT_EQ(during.requested_bytes, before.requested_bytes + n * size);
+
+            efree_batch(ptrs.data(), n);
+            EmallocStats after = emalloc_stats();
+            ASSERT_EQ(after.nb_free[kind], before.nb_free[kind] + n);
+            ASSERT_EQ(after.live_bytes, before.live_bytes);
+        }
+    }
+}
+
+TEST(Batch, mixedfree) {
+    // Allocations of every kind freed together, in any order, and by efree.
+    vector<void *> ptrs;
+    for (unsigned long size: {16UL, 64UL, 100UL, 5000UL, LARGEALLOC + 1UL}) {
+        vector<void *> batch(50);
+        emalloc_batch(size, batch.size(), batch.data());
+        ptrs.insert(ptrs.end(), batch.begin(), batch.end());
+    }
+    ptrs.push_back(ealigned_alloc(256, 1000));
+    ptrs.push_back(nullptr);
+    reverse(ptrs.begin(), ptrs.end());
+    EmallocStats before = emalloc_stats();
+    efree(ptrs[5]);
+    ptrs[5] = nullptr;
+    efree_batch(ptrs.data(), ptrs.size());
+    EmallocStats after = emalloc_stats();
+    ASSERT_EQ(after.nb_free[SMALL_KIND] - before.nb_free[SMALL_KIND], 100UL);
+    ASSERT_EQ(after.nb_free[LARGE_KIND] - before.nb_free[LARGE_KIND], 50UL);
+}
+
+TEST(Batch, mediumtail) {
+    // The tail of the carved block goes back to the arena and merges on free.
+    EmallocStats before = emalloc_stats();
+    vector<void *> ptrs(5);
+    emalloc_batch(1000, ptrs.size(), ptrs.data());
+    fill_and_check(ptrs, 1000);
+    efree_batch(ptrs.data(), ptrs.size());
+    EmallocStats after = emalloc_stats();
+    for (unsigned int i = 0; i < EM_STATS_ORDERS; i++)
+        ASSERT_EQ(after.free_blocks[i], before.free_blocks[i]) << i;
+}
+
+TEST(Batch, threaded) {
+    ASSERT_EQ(emallopt(EM_THREADED, 1), 1);
+    vector<thread> threads;
+    for (int t = 0; t < 4; t++) {
+        threads.emplace_back([t] {
+            for (int round = 0; round < 200; round++) {
+                vector<void *> ptrs(100);
+                unsigned long size = 1 + (t * 997 + round * 31) % 4000;
+                emalloc_batch(size, ptrs.size(), ptrs.data());
+                for (auto p: ptrs)
+                    memset(p, t, size);
+                efree_batch(ptrs.data(), ptrs.size());
+            }
+        });
+    }
+    for (auto &t: threads)
+        t.join();
+    ASSERT_EQ(emallopt(EM_THREADED, 0), 1);
+}
@@ -7,10 +7,18 @@
 #include <gtest/gtest.h>
 #include <string.h>
 #include <assert.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <vector>
+#include <random>
+#include <algorithm>
 #include "../src/mem.h"
 #include "../src/mem_internals.h"
 
 TEST(Medium, buddy) {
+    if (arena.medium_engine != EM_MEDIUM_BUDDY)
+        GTEST_SKIP() << "the main arena uses the TLSF engine";
     constexpr unsigned long ALLOC_MEM_SIZE = FIRST_ALLOC_MEDIUM / 2;
 
     void *mref = emalloc(ALLOC_MEM_SIZE); // first allocation
@@ -52,3 +60,131 @@ TEST(Medium, buddy) {
     efree(mref3);
     ASSERT_NE(nb_TZL_entries(), 1U);
 }
+
+TEST(Medium, manyfree) {
+    constexpr int NB_BLOCKS = 50000;
+    std::vector<void *> tab(NB_BLOCKS);
+
+    for (auto &t: tab) {
+        t = emalloc(65);
+        ASSERT_NE(t, (void *) 0);
+        memset(t, 1, 65);
+    }
+    int medium_next_exponant = arena.medium_next_exponant;
+    // Freeing in random order keeps tens of thousands of blocks free at once.
+    std::shuffle(tab.begin(), tab.end(), std::mt19937_64());
+    for (auto t: tab) {
+        efree(t);
+    }
+    // Everything merged back, the same blocks fit again without growing the arena.
+    void *mref = emalloc(FIRST_ALLOC_MEDIUM / 2);
+    ASSERT_NE(mref, (void *) 0);
+    efree(mref);
+    for (auto &t: tab) {
+        t = emalloc(65);
+        ASSERT_NE(t, (void *) 0);
+    }
+    ASSERT_EQ(arena.medium_next_exponant, medium_next_exponant);
+    for (auto t: tab) {
+        efree(t);
+    }
+}
+
+TEST(Medium, trim) {
+    if (arena.medium_engine != EM_MEDIUM_BUDDY)
+        GTEST_SKIP() << "TLSF pools are not trimmed";
+    constexpr unsigned long ALLOC_MEM_SIZE = FIRST_ALLOC_MEDIUM / 2;
+    long page_size = sysconf(_SC_PAGESIZE);
+
+    ASSERT_EQ(emallopt(EM_TRIM_THRESHOLD, -1), 0);
+    void *mref = emalloc(ALLOC_MEM_SIZE);
+    ASSERT_NE(mref, (void *) 0);
+    memset(mref, 1, ALLOC_MEM_SIZE);
+    void *page = (void *) (((unsigned long) mref + page_size) & ~(page_size - 1));
+    unsigned char resident = 0;
+    ASSERT_EQ(mincore(page, page_size, &resident), 0);
+    ASSERT_EQ(resident & 1, 1);
+
+    // Without any threshold, the superblock goes back to the system as soon as it is fully free.
+    ASSERT_EQ(emallopt(EM_TRIM_THRESHOLD, 0), 1);
+    efree(mref);
+    ASSERT_EQ(arena.empty_bytes, 0UL);
+    ASSERT_EQ(mincore(page, page_size, &resident), 0);
+    ASSERT_EQ(resident & 1, 0);
+
+    // Its pages come back zeroed when it is used again.
+    void *mref2 = emalloc(ALLOC_MEM_SIZE);
+    ASSERT_EQ(mref2, mref);
+    ASSERT_EQ(*(unsigned char *) page, 0);
+    efree(mref2);
+    ASSERT_EQ(emallopt(EM_TRIM_THRESHOLD, DEFAULT_TRIM_THRESHOLD), 1);
+}
+
+TEST(Medium, hugepages) {
+    if (arena.medium_engine != EM_MEDIUM_BUDDY)
+        GTEST_SKIP() << "the main arena uses the TLSF engine";
+    ASSERT_EQ(emallopt(EM_HUGEPAGES, 2), 0);
+    ASSERT_EQ(emallopt(EM_HUGEPAGES, 1), 1);
+    // Enough medium blocks to need a new superblock, then to fill one huge page of it.
+    std::vector<void *> blocks;
+    unsigned int nb_superblocks = nb_TZL_entries();
+    while (nb_TZL_entries() == nb_superblocks)
+        blocks.push_back(emalloc(4096 - 32));
+    for (unsigned long i = 0; i < HUGE_PAGE_SIZE / 4096; i++)
+        blocks.push_back(emalloc(4096 - 32));
+    MemSuperblock *last = NULL;
+    for (auto &superblock: arena.superblocks)
+        if (superblock.base != NULL)
+            last = &superblock;
+    ASSERT_EQ((unsigned long) last->base % HUGE_PAGE_SIZE, 0UL);
+    ASSERT_GE(1UL << (last - arena.superblocks), HUGE_PAGE_SIZE);
+    for (auto b: blocks)
+        memset(b, 1, 4096 - 32);
+    // Huge pages may be disabled by the system, the count can only be bounded.
+    unsigned long hugepage_bytes = emalloc_hugepage_bytes();
+    ASSERT_EQ(hugepage_bytes % HUGE_PAGE_SIZE, 0UL);
+    ASSERT_LE(hugepage_bytes, 2UL << (last - arena.superblocks));
+    for (auto b: blocks)
+        efree(b);
+    ASSERT_EQ(emallopt(EM_HUGEPAGES, 0), 1);
+}
+
+// Pages of address space of the process, read without allocating.
+static unsigned long virtual_pages() {
+    char buffer[128] = {};
+    int fd = open("/proc/self/statm", O_RDONLY);
+    ssize_t nb_read = read(fd, buffer, sizeof(buffer) - 1);
+    close(fd);
+    return nb_read > 0 ? strtoul(buffer, NULL, 10) : 0;
+}
+
+TEST(Medium, superblockslack) {
+    // Only the aligned superblock stays mapped, not the range it was aligned in.
+    int engine = options.medium_engine;
+    ASSERT_EQ(emallopt(EM_MEDIUM_ENGINE, EM_MEDIUM_BUDDY), 1);
+    EArena *a = earena_create();
+    ASSERT_EQ(emallopt(EM_MEDIUM_ENGINE, engine), 1);
+    unsigned long before = virtual_pages();
+    void *blocks[256];
+    for (auto &b: blocks)
+        b = earena_alloc(a, FIRST_ALLOC_MEDIUM / 2 - 32);
+    unsigned long superblock_bytes = 0;
+    unsigned long map_bytes = 0;
+    unsigned long map_pages = 0;
+    long page_size = sysconf(_SC_PAGESIZE);
+    for (unsigned int i = 0; i < TZL_SIZE; i++) {
+        MemSuperblock *superblock = &a->superblocks[i];
+        if (superblock->base == NULL)
+            continue;
+        ASSERT_EQ((unsigned long) superblock->base % (1UL << i), 0UL);
+        superblock_bytes += 1UL << i;
+        map_bytes += 2 * SUPERBLOCK_MAP_BITS(i) / 8;
+        map_pages += (2 * SUPERBLOCK_MAP_BITS(i) / 8 + page_size - 1) / page_size;
+    }
+    ASSERT_GE(superblock_bytes, 128UL * FIRST_ALLOC_MEDIUM);
+    ASSERT_EQ(earena_stats(a).mapped_bytes, superblock_bytes + map_bytes);
+    ASSERT_LE(virtual_pages() - before, superblock_bytes / page_size + map_pages);
+    for (auto b: blocks)
+        earena_free(a, b);
+    earena_destroy(a);
+}
@@ -0,0 +1,63 @@
+/******************************************************
+ * Copyright Grégory Mounié 2008-2018                 *
+ * This code is distributed under the GLPv3+ licence. *
+ * Ce code est distribué sous la licence GPLv3+.      *
+ ******************************************************/
+
+#include <gtest/gtest.h>
+#include <string.h>
+#include <vector>
+
+#include "../src/mem.h"
+#include "../src/mem_internals.h"
+
+using namespace std;
+
+static bool is_zero(void *ptr, unsigned long size) {
+    for (unsigned long i = 0; i < size; i++)
+        if (((unsigned char *) ptr)[i] != 0)
+            return false;
+    return true;
+}
+
+TEST(Calloc, overflow) {
+    ASSERT_EQ(ecalloc(0, 10), nullptr);
+    ASSERT_EQ(ecalloc(1UL << 33, 1UL << 33), nullptr);
+}
+
+TEST(Calloc, dirtyreuse) {
+    // Every kind gives zeroed memory even after being written and freed.
+    for (unsigned long size: {10UL, 1000UL, 40000UL, 4UL * LARGEALLOC}) {
+        vector<void *> dirty(8);
+        for (auto &d: dirty) {
+            d = emalloc(size);
+            memset(d, 0xff, size);
+        }
+        for (auto d: dirty)
+            efree(d);
+        for (auto &d: dirty) {
+            d = ecalloc(size / 2, 2);
+            ASSERT_TRUE(is_zero(d, size)) << size;
+            memset(d, 0xff, size);
+        }
+        for (auto d: dirty)
+            efree(d);
+    }
+}
+
+TEST(Calloc, trimmedsuperblock) {
+    constexpr unsigned long ALLOC_MEM_SIZE = FIRST_ALLOC_MEDIUM / 2;
+
+    void *ptr = emalloc(ALLOC_MEM_SIZE);
+    memset(ptr, 0xff, ALLOC_MEM_SIZE);
+    // The released superblock comes back zeroed, splitting it keeps its halves zeroed.
+    ASSERT_EQ(emallopt(EM_TRIM_THRESHOLD, 0), 1);
+    efree(ptr);
+    void *half = ecalloc(1, ALLOC_MEM_SIZE / 2);
+    ASSERT_TRUE(is_zero(half, ALLOC_MEM_SIZE / 2));
+    void *quarter = ecalloc(1, ALLOC_MEM_SIZE / 4);
+    ASSERT_TRUE(is_zero(quarter, ALLOC_MEM_SIZE / 4));
+    efree(quarter);
+    efree(half);
+    ASSERT_EQ(emallopt(EM_TRIM_THRESHOLD, DEFAULT_TRIM_THRESHOLD), 1);
+}
@@ -6,6 +6,8 @@
 
 #include <sys/time.h>
 #include <sys/resource.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 #include <gtest/gtest.h>
 #include <vector>
@@ -36,6 +38,76 @@ TEST(Basic, onelargesmall) {
     efree(ptr);
 }
 
+TEST(Basic, smallclasses) {
+    for (unsigned long size = 1; size <= SMALLALLOC; size++) {
+        void *ptr = emalloc(size);
+        ASSERT_NE(ptr, nullptr);
+        memset(ptr, 1, size);
+        // The chunk is the smallest class holding the request.
+        ASSERT_TRUE(is_small_chunk(&arena, ptr));
+        ASSERT_EQ(get_slab(ptr)->magic, SLAB_MAGIC);
+        ASSERT_EQ(SMALL_CHUNKSIZE(get_slab(ptr)->size_class),
+                  (size + SMALL_CLASS_STEP - 1) / SMALL_CLASS_STEP * SMALL_CLASS_STEP);
+        efree(ptr);
+    }
+}
+
+TEST(Basic, slab) {
+    // Chunks have no header, consecutive ones are one class size apart.
+    void *ptr = emalloc(16);
+    void *ptr2 = emalloc(16);
+    ASSERT_EQ((unsigned long) ptr2 - (unsigned long) ptr, 16UL);
+    ASSERT_EQ(get_slab(ptr), get_slab(ptr2));
+    efree(ptr2);
+    efree(ptr);
+
+    // Other kinds are not taken for small chunks.
+    void *medium = emalloc(SMALLALLOC + 1);
+    void *large = emalloc(LARGEALLOC);
+    void *aligned = ealigned_alloc(64, 32);
+    ASSERT_FALSE(is_small_chunk(&arena, medium));
+    ASSERT_FALSE(is_small_chunk(&arena, large));
+    ASSERT_FALSE(is_small_chunk(&arena, aligned));
+    efree(aligned);
+    efree(large);
+    efree(medium);
+}
+
+TEST(Basic, smallcarving) {
+    // Chunks are only written when they are carved, the rest of the run stays untouched.
+    EArena *a = earena_create();
+    earena_alloc(a, 16);
+    ASSERT_EQ(a->small_chunks[0], 1UL);
+    long page_size = sysconf(_SC_PAGESIZE);
+    vector<unsigned char> resident(SLAB_SIZE / page_size);
+    ASSERT_EQ(mincore(a->small_region, SLAB_SIZE, resident.data()), 0);
+    unsigned long nb_resident = 0;
+    for (auto r: resident)
+        nb_resident += r & 1;
+    ASSERT_EQ(nb_resident, 1UL);
+
+    // Runs stop doubling: the slabs reserved but not carved yet are less than one run.
+    for (int i = 0; i < 200000; i++)
+        earena_alloc(a, 64);
+    unsigned long carved = a->small_chunks[3] / ((SLAB_SIZE - SLAB_HEADER) / 64) * SLAB_SIZE;
+    ASSERT_LT(a->small_region_used - SLAB_SIZE - carved, (SLAB_SIZE << SMALL_RUN_MAX_EXPOSANT) + SLAB_SIZE);
+    earena_destroy(a);
+}
+
+TEST(Basic, usablesize) {
+    ASSERT_EQ(emalloc_usable_size(nullptr), 0UL);
+    for (unsigned long size: {1UL, 48UL, 100UL, 5000UL, LARGEALLOC + 1UL}) {
+        void *ptr = emalloc(size);
+        ASSERT_GE(emalloc_usable_size(ptr), size);
+        memset(ptr, 1, emalloc_usable_size(ptr));
+        efree(ptr);
+    }
+    // Aligned allocations are marked, up to the footer after the request.
+    void *aligned = ealigned_alloc(256, 100);
+    ASSERT_GE(emalloc_usable_size(aligned), 100UL);
+    efree(aligned);
+}
+
 TEST(Basic, onemedium) {
     void *ptr = emalloc(65);
     ASSERT_NE(ptr, nullptr);
@@ -0,0 +1,137 @@
+/******************************************************
+ * Copyright Grégory Mounié 2008-2018                 *
+ * This code is distributed under the GLPv3+ licence. *
+ * Ce code est distribué sous la licence GPLv3+.      *
+ ******************************************************/
+
+#include <gtest/gtest.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include "../src/mem.h"
+#include "../src/mem_internals.h"
+
+TEST(Large, cachereuse) {
+    void *ptr = emalloc(LARGEALLOC);
+    ASSERT_NE(ptr, nullptr);
+    memset(ptr, 1, LARGEALLOC);
+    efree(ptr);
+    unsigned long cached = arena.large_cached_bytes;
+    ASSERT_GT(cached, (unsigned long) LARGEALLOC);
+
+    // The same page rounded size gets the cached mapping back.
+    void *ptr2 = emalloc(LARGEALLOC + 1);
+    ASSERT_EQ(ptr2, ptr);
+    ASSERT_EQ(arena.large_cached_bytes, cached - mark_check_and_get_alloc(ptr2).size);
+    memset(ptr2, 1, LARGEALLOC + 1);
+    efree(ptr2);
+}
+
+TEST(Large, cachebestfit) {
+    // Start from an empty cache, earlier tests may have left segments in the bin.
+    ASSERT_EQ(emallopt(EM_LARGE_CACHE_MAX, 0), 1);
+    ASSERT_EQ(emallopt(EM_LARGE_CACHE_MAX, DEFAULT_LARGE_CACHE_MAX), 1);
+    void *big = emalloc(3 * LARGEALLOC);
+    void *small = emalloc(2 * LARGEALLOC + 1);
+    efree(big);
+    efree(small);
+
+    // Both are in the same bin, the smallest one holding the request is used.
+    void *ptr = emalloc(2 * LARGEALLOC);
+    ASSERT_EQ(ptr, small);
+    efree(ptr);
+}
+
+TEST(Large, cachenextbin) {
+    ASSERT_EQ(emallopt(EM_LARGE_CACHE_MAX, 0), 1);
+    ASSERT_EQ(emallopt(EM_LARGE_CACHE_MAX, DEFAULT_LARGE_CACHE_MAX), 1);
+    void *big = emalloc(3 * LARGEALLOC);
+    efree(big);
+    // More than twice the request, a new segment is mapped.
+    void *ptr = emalloc(LARGEALLOC);
+    ASSERT_NE(ptr, big);
+    efree(ptr);
+    // The bin of the request is empty, the segment of the next one is reused.
+    ptr = emalloc(2 * LARGEALLOC - 100);
+    ASSERT_EQ(ptr, big);
+    efree(ptr);
+}
+
+TEST(Large, cacheeviction) {
+    ASSERT_EQ(emallopt(EM_LARGE_CACHE_MAX, -1), 0);
+    ASSERT_EQ(emallopt(EM_LARGE_CACHE_MAX, 4 * LARGEALLOC), 1);
+    ASSERT_LE(arena.large_cached_bytes, 4UL * LARGEALLOC);
+
+    void *ptrs[4];
+    for (auto &p: ptrs)
+        p = emalloc(LARGEALLOC);
+    for (auto p: ptrs)
+        efree(p);
+    // Only the most recently freed segments fit in the cache.
+    ASSERT_LE(arena.large_cached_bytes, 4UL * LARGEALLOC);
+    ASSERT_EQ((void *) arena.large_newest, (char *) ptrs[3] - 16);
+
+    ASSERT_EQ(emallopt(EM_LARGE_CACHE_MAX, 0), 1);
+    ASSERT_EQ(arena.large_cached_bytes, 0UL);
+    ASSERT_EQ(arena.large_oldest, nullptr);
+    ASSERT_EQ(emallopt(EM_LARGE_CACHE_MAX, DEFAULT_LARGE_CACHE_MAX), 1);
+}
+
+TEST(Large, toobig) {
+    // The marks and the page rounding would wrap, no segment is mapped.
+    volatile unsigned long huge = SIZE_MAX - 8;
+    for (unsigned long size: {(unsigned long) SIZE_MAX, (unsigned long) huge, 1UL << 50}) {
+        ASSERT_EQ(emalloc(size), nullptr);
+        ASSERT_EQ(ecalloc(1, size), nullptr);
+        ASSERT_EQ(erealloc(nullptr, size), nullptr);
+        ASSERT_EQ(ealigned_alloc(64, size), nullptr);
+        ASSERT_EQ(ealigned_alloc(1UL << 20, size), nullptr);
+        void *ptr = &ptr;
+        ASSERT_EQ(eposix_memalign(&ptr, 64, size), ENOMEM);
+        void *batch[2];
+        ASSERT_EQ(emalloc_batch(size, 2, batch), 0UL);
+        ASSERT_EQ(batch[0], nullptr);
+        EArena *a = earena_create();
+        ASSERT_EQ(earena_alloc(a, size), nullptr);
+        earena_destroy(a);
+    }
+    // The allocation is kept when it can not grow.
+    char *ptr = (char *) emalloc(LARGEALLOC);
+    memset(ptr, 3, LARGEALLOC);
+    ASSERT_EQ(erealloc(ptr, huge), nullptr);
+    ASSERT_EQ(ptr[LARGEALLOC - 1], 3);
+    efree(ptr);
+
+    // The same through the C library, or through emalloc when it is preloaded.
+    errno = 0;
+    ASSERT_EQ(malloc(huge), nullptr);
+    ASSERT_EQ(errno, ENOMEM);
+    errno = 0;
+    ASSERT_EQ(realloc(nullptr, huge), nullptr);
+    ASSERT_EQ(errno, ENOMEM);
+    errno = 0;
+    ASSERT_EQ(calloc(1, huge), nullptr);
+    ASSERT_EQ(errno, ENOMEM);
+    errno = 0;
+    ASSERT_EQ(aligned_alloc(64, huge & ~63UL), nullptr);
+    ASSERT_EQ(errno, ENOMEM);
+}
+
+// Once the address space is limited, every new mapping fails.
+static void allocate_without_address_space() {
+    struct rlimit limit = {0, 0};
+    setrlimit(RLIMIT_AS, &limit);
+    emallopt(EM_LARGE_CACHE_MAX, 0);
+    bool failed = emalloc(4 * LARGEALLOC) == NULL && ecalloc(4, LARGEALLOC) == NULL &&
+                  ealigned_alloc(1UL << 20, LARGEALLOC) == NULL;
+    _exit(failed ? 0 : 1);
+}
+
+TEST(Large, mapfailure) {
+    // The allocations fail and the program goes on.
+    ASSERT_EXIT(allocate_without_address_space(), ::testing::ExitedWithCode(0), "");
+}
@@ -59,3 +59,26 @@ TEST(Mark, mmix) {
     ASSERT_EQ(a32.ptr, tab);
 
 }
+
+TEST(Mark, checklevels) {
+    unsigned long tab[NBCHUNK] = {};
+    // The build may start at any level.
+    int level = options.check_level;
+
+    ASSERT_EQ(emallopt(EM_CHECK_LEVEL, 3), 0);
+    ASSERT_EQ(emallopt(EM_CHECK_LEVEL, EM_CHECK_FULL), 1);
+    void *pmem = mark_memarea_and_get_user_ptr(tab, 64, MEDIUM_KIND);
+    // A damaged footer is only seen by the full check.
+    tab[6] ^= 0b100;
+    ASSERT_DEATH(mark_check_and_get_alloc(pmem), "corrupted footer");
+    ASSERT_EQ(emallopt(EM_CHECK_LEVEL, EM_CHECK_CANARY), 1);
+    ASSERT_EQ(mark_check_and_get_alloc(pmem).kind, MEDIUM_KIND);
+    // A damaged header is seen by the canary, the kind and the size are still read without checks.
+    tab[1] ^= 0b100;
+    ASSERT_DEATH(mark_check_and_get_alloc(pmem), "corrupted header");
+    ASSERT_EQ(emallopt(EM_CHECK_LEVEL, EM_CHECK_OFF), 1);
+    Alloc a = mark_check_and_get_alloc(pmem);
+    ASSERT_EQ(a.kind, MEDIUM_KIND);
+    ASSERT_EQ(a.size, 64UL);
+    ASSERT_EQ(emallopt(EM_CHECK_LEVEL, level), 1);
+}
@@ -0,0 +1,90 @@
+/******************************************************
+ * Copyright Grégory Mounié 2008-2018                 *
+ * This code is distributed under the GLPv3+ licence. *
+ * Ce code est distribué sous la licence GPLv3+.      *
+ ******************************************************/
+
+#include <gtest/gtest.h>
+#include <string.h>
+
+#include "../src/mem.h"
+#include "../src/mem_internals.h"
+
+static bool is_filled(void *ptr, unsigned long size, unsigned char value) {
+    for (unsigned long i = 0; i < size; i++)
+        if (((unsigned char *) ptr)[i] != value)
+            return false;
+    return true;
+}
+
+TEST(Realloc, nullandzero) {
+    void *ptr = erealloc(nullptr, 10);
+    ASSERT_NE(ptr, nullptr);
+    memset(ptr, 1, 10);
+    ASSERT_EQ(erealloc(ptr, 0), nullptr);
+}
+
+TEST(Realloc, smallclass) {
+    void *ptr = emalloc(20);
+    memset(ptr, 1, 20);
+    // Same size class, the chunk is kept.
+    ASSERT_EQ(erealloc(ptr, 32), ptr);
+    void *ptr2 = erealloc(ptr, 48);
+    ASSERT_TRUE(is_filled(ptr2, 20, 1));
+    efree(ptr2);
+}
+
+TEST(Realloc, mediuminplace) {
+    // Tlsf.resize covers the other engine.
+    if (arena.medium_engine != EM_MEDIUM_BUDDY)
+        GTEST_SKIP() << "the main arena uses the TLSF engine";
+    constexpr unsigned long ALLOC_MEM_SIZE = FIRST_ALLOC_MEDIUM / 2;
+
+    void *ptr = emalloc(ALLOC_MEM_SIZE);
+    memset(ptr, 1, ALLOC_MEM_SIZE);
+    // Shrinking splits the block and frees its upper halves.
+    ASSERT_EQ(erealloc(ptr, 100), ptr);
+    ASSERT_EQ(mark_check_and_get_alloc(ptr).size, 132UL);
+    ASSERT_TRUE(is_filled(ptr, 100, 1));
+    // They are still free, growing merges them back.
+    ASSERT_EQ(erealloc(ptr, ALLOC_MEM_SIZE), ptr);
+    ASSERT_TRUE(is_filled(ptr, 100, 1));
+    memset(ptr, 2, ALLOC_MEM_SIZE);
+
+    // An allocated upper buddy forces a move.
+    void *shrunk = erealloc(ptr, 100);
+    void *buddy = emalloc(100);
+    ASSERT_EQ((unsigned long) buddy ^ (unsigned long) shrunk, 256UL);
+    void *moved = erealloc(shrunk, 300);
+    ASSERT_NE(moved, shrunk);
+    ASSERT_TRUE(is_filled(moved, 100, 2));
+    efree(buddy);
+    efree(moved);
+}
+
+TEST(Realloc, large) {
+    void *ptr = emalloc(LARGEALLOC);
+    memset(ptr, 1, LARGEALLOC);
+    void *ptr2 = erealloc(ptr, 16 * LARGEALLOC);
+    ASSERT_TRUE(is_filled(ptr2, LARGEALLOC, 1));
+    memset(ptr2, 2, 16 * LARGEALLOC);
+    void *ptr3 = erealloc(ptr2, 2 * LARGEALLOC);
+    ASSERT_TRUE(is_filled(ptr3, 2 * LARGEALLOC, 2));
+    efree(ptr3);
+}
+
+TEST(Realloc, acrosskinds) {
+    void *ptr = emalloc(10);
+    memset(ptr, 3, 10);
+    ptr = erealloc(ptr, 1000);
+    ASSERT_EQ(mark_check_and_get_alloc(ptr).kind, MEDIUM_KIND);
+    ASSERT_TRUE(is_filled(ptr, 10, 3));
+    memset(ptr, 3, 1000);
+    ptr = erealloc(ptr, 2 * LARGEALLOC);
+    ASSERT_EQ(mark_check_and_get_alloc(ptr).kind, LARGE_KIND);
+    ASSERT_TRUE(is_filled(ptr, 1000, 3));
+    ptr = erealloc(ptr, 50);
+    ASSERT_TRUE(is_small_chunk(&arena, ptr));
+    ASSERT_TRUE(is_filled(ptr, 50, 3));
+    efree(ptr);
+}
@@ -0,0 +1,74 @@
+/******************************************************
+ * Copyright Grégory Mounié 2008-2018                 *
+ * This code is distributed under the GLPv3+ licence. *
+ * Ce code est distribué sous la licence GPLv3+.      *
+ ******************************************************/
+
+#include <gtest/gtest.h>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+#include "../src/mem.h"
+#include "../src/mem_internals.h"
+
+using namespace std;
+
+TEST(Region, alloc) {
+    ERegion *r = eregion_create();
+    ASSERT_NE(r, nullptr);
+    ASSERT_EQ(eregion_alloc(r, 0), nullptr);
+    ASSERT_EQ(eregion_alloc(r, ~0UL), nullptr);
+    // Consecutive objects follow each other, aligned and without header.
+    char *first = (char *) eregion_alloc(r, 24);
+    char *second = (char *) eregion_alloc(r, 1);
+    ASSERT_EQ((uintptr_t) first % 16, 0UL);
+    ASSERT_EQ(second, first + 32);
+    // Many chunks, and objects larger than a chunk.
+    vector<pair<char *, unsigned long>> objects;
+    for (unsigned long i = 0; i < 20000; i++) {
+        unsigned long size = i % 1000 == 0 ? REGION_CHUNK_SIZE + i : 1 + i % 200;
+        char *ptr = (char *) eregion_alloc(r, size);
+        ASSERT_EQ((uintptr_t) ptr % 16, 0UL);
+        memset(ptr, i, size);
+        objects.push_back({ptr, size});
+    }
+    for (unsigned long i = 0; i < objects.size(); i++) {
+        ASSERT_EQ((unsigned char) objects[i].first[0], (unsigned char) i);
+        ASSERT_EQ((unsigned char) objects[i].first[objects[i].second - 1], (unsigned char) i);
+    }
+    eregion_destroy(r);
+}
+
+TEST(Region, release) {
+    EmallocStats before = emalloc_stats();
+    ERegion *r = eregion_create();
+    eregion_alloc(r, 100);
+    ERegionMark outer = eregion_mark(r);
+    char *at_outer = (char *) eregion_alloc(r, 48);
+    for (int i = 0; i < 5000; i++)
+        eregion_alloc(r, 64);
+    ERegionMark inner = eregion_mark(r);
+    char *at_inner = (char *) eregion_alloc(r, 48);
+    eregion_alloc(r, 3 * REGION_CHUNK_SIZE);
+    // Releasing gives the same addresses again.
+    eregion_release(r, inner);
+    ASSERT_EQ(eregion_alloc(r, 48), at_inner);
+    eregion_release(r, outer);
+    ASSERT_EQ(eregion_alloc(r, 48), at_outer);
+    // Around a chunk boundary, the spare chunk is reused.
+    for (int i = 0; i < 10; i++) {
+        ERegionMark mark = eregion_mark(r);
+        EmallocStats during = emalloc_stats();
+        eregion_alloc(r, REGION_CHUNK_SIZE / 2);
+        eregion_alloc(r, REGION_CHUNK_SIZE / 2);
+        eregion_release(r, mark);
+        EmallocStats after = emalloc_stats();
+        if (i > 0) {
+            ASSERT_EQ(after.nb_alloc[MEDIUM_KIND], during.nb_alloc[MEDIUM_KIND]);
+        }
+    }
+    eregion_destroy(r);
+    EmallocStats after = emalloc_stats();
+    ASSERT_EQ(after.live_bytes, before.live_bytes);
+}
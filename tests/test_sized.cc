@@ -0,0 +1,77 @@
+/******************************************************
+ * Copyright Grégory Mounié 2008-2018                 *
+ * This code is distributed under the GLPv3+ licence. *
+ * Ce code est distribué sous la licence GPLv3+.      *
+ ******************************************************/
+
+#include <gtest/gtest.h>
+#include <string.h>
+#include <vector>
+
+#include "../src/mem.h"
+#include "../src/mem_internals.h"
+
+using namespace std;
+
+TEST(Sized, allkinds) {
+    for (int sized: {0, 1}) {
+        ASSERT_EQ(emallopt(EM_CHECK_SIZED, sized), 1);
+        for (unsigned long size: {1UL, 33UL, (unsigned long) SMALLALLOC, SMALLALLOC + 1UL, 1000UL, LARGEALLOC - 1UL,
+                                  (unsigned long) LARGEALLOC, 3UL * LARGEALLOC}) {
+            EmallocStats before = emalloc_stats();
+            void *ptr = emalloc(size);
+            memset(ptr, 1, size);
+            efree_sized(ptr, size);
+            EmallocStats after = emalloc_stats();
+            ASSERT_EQ(after.live_bytes, before.live_bytes) << size;
+            // The same block comes back, the free went where efree would have put it.
+            void *again = emalloc(size);
+            if (size < LARGEALLOC) {
+                ASSERT_EQ(again, ptr) << size;
+            }
+            efree(again);
+        }
+    }
+    ASSERT_EQ(emallopt(EM_CHECK_SIZED, 0), 1);
+}
+
+TEST(Sized, realloccalloc) {
+    // The size is the last one requested, nmemb * size for ecalloc.
+    void *ptr = ecalloc(10, 100);
+    efree_sized(ptr, 1000);
+    ptr = emalloc(3000);
+    ptr = erealloc(ptr, 2000);
+    efree_sized(ptr, 2000);
+    ptr = emalloc(20);
+    ptr = erealloc(ptr, 30);
+    efree_sized(ptr, 30);
+}
+
+TEST(Sized, mismatch) {
+    ASSERT_EQ(emallopt(EM_CHECK_SIZED, 2), 0);
+    ASSERT_EQ(emallopt(EM_CHECK_SIZED, 1), 1);
+    void *small = emalloc(20);
+    ASSERT_DEATH(efree_sized(small, 40), "corrupted size");
+    ASSERT_DEATH(efree_sized(small, 1000), "corrupted size");
+    void *medium = emalloc(1000);
+    ASSERT_DEATH(efree_sized(medium, 1001), "corrupted size");
+    ASSERT_DEATH(efree_sized(medium, 20), "corrupted size");
+    efree_sized(small, 20);
+    efree_sized(medium, 1000);
+    ASSERT_EQ(emallopt(EM_CHECK_SIZED, 0), 1);
+}
+
+TEST(Sized, nomarkread) {
+    // Off by default, whatever the check level: the footer is not read.
+    int level = options.check_level;
+    ASSERT_EQ(emallopt(EM_CHECK_LEVEL, EM_CHECK_FULL), 1);
+    ASSERT_FALSE(options.check_sized);
+    char *ptr = (char *) emalloc(1000);
+    unsigned long footer = *(unsigned long *) (ptr + 1000);
+    *(unsigned long *) (ptr + 1000) = ~footer;
+    ASSERT_EQ(emallopt(EM_CHECK_SIZED, 1), 1);
+    ASSERT_DEATH(efree_sized(ptr, 1000), "corrupted footer");
+    ASSERT_EQ(emallopt(EM_CHECK_SIZED, 0), 1);
+    efree_sized(ptr, 1000);
+    ASSERT_EQ(emallopt(EM_CHECK_LEVEL, level), 1);
+}
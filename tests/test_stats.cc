@@ -0,0 +1,87 @@
+/******************************************************
+ * Copyright Grégory Mounié 2008-2018                 *
+ * This code is distributed under the GLPv3+ licence. *
+ * Ce code est distribué sous la licence GPLv3+.      *
+ ******************************************************/
+
+#include <gtest/gtest.h>
+#include <thread>
+#include <vector>
+
+#include "../src/mem.h"
+#include "../src/mem_internals.h"
+
+using namespace std;
+
+TEST(Stats, counters) {
+    EmallocStats before = emalloc_stats();
+    void *small = emalloc(20);
+    void *medium = emalloc(1000);
+    void *large = emalloc(LARGEALLOC);
+    EmallocStats during = emalloc_stats();
+
+    for (int kind = SMALL_KIND; kind <= LARGE_KIND; kind++)
+        ASSERT_EQ(during.nb_alloc[kind], before.nb_alloc[kind] + 1);
+    ASSERT_EQ(during.small_used[1], before.small_used[1] + 1);
+    ASSERT_LE(during.small_used[1], during.small_chunks[1]);
+    // The blocks are a 32 bytes chunk, a medium block with its mark, 2 KiB from the
+    // buddy engine, and a whole number of pages.
+    unsigned long medium_block = medium_block_size(&arena, 1000UL + 32UL);
+    unsigned long live = during.live_bytes - before.live_bytes;
+    ASSERT_GE(live, 32UL + medium_block + LARGEALLOC + 32UL);
+    ASSERT_EQ((live - 32UL - medium_block) % sysconf(_SC_PAGESIZE), 0UL);
+    ASSERT_EQ(during.requested_bytes - before.requested_bytes, 20UL + 1000UL + LARGEALLOC);
+    ASSERT_EQ(during.block_bytes - before.block_bytes, live);
+    ASSERT_GE(during.mapped_bytes, during.live_bytes);
+
+    efree(large);
+    efree(medium);
+    efree(small);
+    EmallocStats after = emalloc_stats();
+    for (int kind = SMALL_KIND; kind <= LARGE_KIND; kind++)
+        ASSERT_EQ(after.nb_free[kind], before.nb_free[kind] + 1);
+    ASSERT_EQ(after.live_bytes, before.live_bytes);
+    ASSERT_EQ(after.small_used[1], before.small_used[1]);
+}
+
+TEST(Stats, freeblocks) {
+    if (arena.medium_engine != EM_MEDIUM_BUDDY)
+        GTEST_SKIP() << "the free blocks are read from the buddy lists";
+    // Counted by order, the sum is the free memory of the medium arena.
+    void *ptr = emalloc(SMALLALLOC + 1);
+    EmallocStats stats = emalloc_stats();
+    unsigned long nb_free_blocks = 0;
+    for (unsigned int i = 0; i < EM_STATS_ORDERS; i++) {
+        unsigned long nb = 0;
+        for (void *block = arena.TZL[i]; block != NULL; block = *(void **) block)
+            nb++;
+        ASSERT_EQ(stats.free_blocks[i], nb);
+        nb_free_blocks += nb;
+    }
+    ASSERT_GT(nb_free_blocks, 0UL);
+    efree(ptr);
+}
+
+TEST(Stats, threads) {
+    EmallocStats before = emalloc_stats();
+    ASSERT_EQ(emallopt(EM_THREADED, 1), 1);
+    vector<thread> threads;
+    for (int i = 0; i < 4; i++) {
+        threads.emplace_back([] {
+            vector<void *> ptrs;
+            for (unsigned long size = 1; size < 4 * LARGEALLOC; size = size * 3 / 2 + 1)
+                ptrs.push_back(emalloc(size));
+            for (auto p: ptrs)
+                efree(p);
+        });
+    }
+    for (auto &t: threads)
+        t.join();
+    // Exited threads merged their counters.
+    EmallocStats after = emalloc_stats();
+    ASSERT_EQ(emallopt(EM_THREADED, 0), 1);
+    ASSERT_GT(after.nb_alloc[SMALL_KIND], before.nb_alloc[SMALL_KIND]);
+    for (int kind = SMALL_KIND; kind <= LARGE_KIND; kind++)
+        ASSERT_EQ(after.nb_alloc[kind] - before.nb_alloc[kind], after.nb_free[kind] - before.nb_free[kind]);
+    ASSERT_EQ(after.live_bytes, before.live_bytes);
+}
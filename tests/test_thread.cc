@@ -0,0 +1,166 @@
+/******************************************************
+ * Copyright Grégory Mounié 2008-2018                 *
+ * This code is distributed under the GLPv3+ licence. *
+ * Ce code est distribué sous la licence GPLv3+.      *
+ ******************************************************/
+
+#include <gtest/gtest.h>
+#include <string.h>
+#include <thread>
+#include <mutex>
+#include <vector>
+#include <random>
+
+#include "../src/mem.h"
+#include "../src/mem_internals.h"
+
+using namespace std;
+
+constexpr int NB_THREADS = 8;
+constexpr int NB_ROUNDS = 2000;
+
+static unsigned long random_size(mt19937_64 &gen) {
+    switch (gen() % 3) {
+        case 0:
+            return 1 + gen() % SMALLALLOC;
+        case 1:
+            return SMALLALLOC + 1 + gen() % (4 * 1024);
+        default:
+            return SMALLALLOC + 1 + gen() % (LARGEALLOC - SMALLALLOC - 64);
+    }
+}
+
+static void churn(int seed, bool *ok) {
+    mt19937_64 gen(seed);
+    vector<pair<unsigned char *, unsigned long>> live;
+
+    for (int i = 0; i < NB_ROUNDS; i++) {
+        if (live.empty() || gen() % 3 != 0) {
+            unsigned long size = random_size(gen);
+            auto *ptr = (unsigned char *) emalloc(size);
+            memset(ptr, seed, size);
+            live.emplace_back(ptr, size);
+        } else {
+            auto victim = live.begin() + gen() % live.size();
+            // Another thread writing in the block would have changed its content.
+            for (unsigned long j = 0; j < victim->second; j++)
+                if (victim->first[j] != (unsigned char) seed)
+                    *ok = false;
+            efree(victim->first);
+            live.erase(victim);
+        }
+    }
+    for (auto &l: live)
+        efree(l.first);
+}
+
+TEST(Thread, emallopt) {
+    ASSERT_EQ(emallopt(EM_THREADED, 2), 0);
+    ASSERT_EQ(emallopt(-1, 0), 0);
+    ASSERT_EQ(emallopt(EM_THREADED, 0), 1);
+}
+
+TEST(Thread, concurrentchurn) {
+    vector<thread> threads;
+    bool ok[NB_THREADS];
+
+    ASSERT_EQ(emallopt(EM_THREADED, 1), 1);
+    for (int i = 0; i < NB_THREADS; i++) {
+        ok[i] = true;
+        threads.emplace_back(churn, i + 1, &ok[i]);
+    }
+    for (auto &t: threads)
+        t.join();
+    ASSERT_EQ(emallopt(EM_THREADED, 0), 1);
+    for (int i = 0; i < NB_THREADS; i++)
+        ASSERT_TRUE(ok[i]);
+}
+
+TEST(Thread, crossthreadfree) {
+    mutex m;
+    vector<void *> handoff;
+    bool done = false;
+
+    ASSERT_EQ(emallopt(EM_THREADED, 1), 1);
+    // Blocks allocated by one thread end in the cache of another one.
+    thread producer([&] {
+        mt19937_64 gen(42);
+        for (int i = 0; i < NB_ROUNDS * 4; i++) {
+            unsigned long size = random_size(gen);
+            void *ptr = emalloc(size);
+            memset(ptr, 1, size);
+            lock_guard<mutex> guard(m);
+            handoff.push_back(ptr);
+        }
+        lock_guard<mutex> guard(m);
+        done = true;
+    });
+    thread consumer([&] {
+        for (;;) {
+            vector<void *> todo;
+            bool finished;
+            {
+                lock_guard<mutex> guard(m);
+                todo.swap(handoff);
+                finished = done;
+            }
+            for (auto p: todo)
+                efree(p);
+            if (finished && todo.empty())
+                break;
+        }
+    });
+    producer.join();
+    consumer.join();
+
+    // Exited threads gave their caches back, the main thread can still allocate.
+    void *ptr = emalloc(65);
+    ASSERT_NE(ptr, nullptr);
+    memset(ptr, 1, 65);
+    efree(ptr);
+    ASSERT_EQ(emallopt(EM_THREADED, 0), 1);
+}
+
+TEST(Thread, smallpool) {
+    constexpr unsigned long NB_CHUNKS = 600;
+    vector<thread> threads;
+    bool ok[NB_THREADS];
+    EmallocStats before = emalloc_stats();
+
+    ASSERT_EQ(emallopt(EM_THREADED, 1), 1);
+    // Runs larger than the caches go through the shared pools at every round.
+    for (int t = 0; t < NB_THREADS; t++) {
+        ok[t] = true;
+        threads.emplace_back([t, &ok] {
+            mt19937_64 gen(t);
+            vector<void *> ptrs(NB_CHUNKS);
+            for (int round = 0; round < NB_ROUNDS / 4; round++) {
+                unsigned long size = SMALL_CHUNKSIZE(gen() % SMALL_CLASSES);
+                unsigned long n = 1 + gen() % NB_CHUNKS;
+                emalloc_batch(size, n, ptrs.data());
+                for (unsigned long i = 0; i < n; i++)
+                    memset(ptrs[i], t + 1, size);
+                this_thread::yield();
+                // A chunk given to two threads would have been overwritten.
+                for (unsigned long i = 0; i < n; i++)
+                    for (unsigned long j = 0; j < size; j++)
+                        if (((unsigned char *) ptrs[i])[j] != (unsigned char) (t + 1))
+                            ok[t] = false;
+                if (round % 2 == 0) {
+                    efree_batch(ptrs.data(), n);
+                } else {
+                    for (unsigned long i = 0; i < n; i++)
+                        efree(ptrs[i]);
+                }
+            }
+        });
+    }
+    for (auto &t: threads)
+        t.join();
+    ASSERT_EQ(emallopt(EM_THREADED, 0), 1);
+    for (int i = 0; i < NB_THREADS; i++)
+        ASSERT_TRUE(ok[i]);
+    EmallocStats after = emalloc_stats();
+    for (unsigned int i = 0; i < SMALL_CLASSES; i++)
+        ASSERT_EQ(after.small_used[i], before.small_used[i]);
+}
@@ -0,0 +1,158 @@
+/******************************************************
+ * Copyright Grégory Mounié 2008-2018                 *
+ * This code is distributed under the GLPv3+ licence. *
+ * Ce code est distribué sous la licence GPLv3+.      *
+ ******************************************************/
+
+#include <gtest/gtest.h>
+#include <string.h>
+#include <random>
+#include <vector>
+
+#include "../src/mem.h"
+#include "../src/mem_internals.h"
+
+using namespace std;
+
+// Arenas created with the TLSF engine, the main arena keeps its own.
+static EArena *create_tlsf_arena() {
+    int engine = options.medium_engine;
+    EXPECT_EQ(emallopt(EM_MEDIUM_ENGINE, EM_MEDIUM_TLSF), 1);
+    EArena *a = earena_create();
+    EXPECT_EQ(emallopt(EM_MEDIUM_ENGINE, engine), 1);
+    return a;
+}
+
+static unsigned long nb_free_blocks(EArena *a) {
+    unsigned long nb = 0;
+    for (unsigned int i = 0; i < TZL_SIZE; i++)
+        nb += earena_stats(a).free_blocks[i];
+    return nb;
+}
+
+TEST(Tlsf, emallopt) {
+    ASSERT_EQ(emallopt(EM_MEDIUM_ENGINE, 2), 0);
+    ASSERT_EQ(emallopt(EM_MEDIUM_ENGINE, -1), 0);
+    EArena *a = create_tlsf_arena();
+    ASSERT_EQ(a->medium_engine, EM_MEDIUM_TLSF);
+    earena_destroy(a);
+}
+
+TEST(Tlsf, finerclasses) {
+    // A 1100 bytes request takes 2 KiB from the buddy engine.
+    EArena *a = create_tlsf_arena();
+    void *ptr = earena_alloc(a, 1100);
+    memset(ptr, 1, 1100);
+    EmallocStats stats = earena_stats(a);
+    ASSERT_EQ(stats.block_bytes, TLSF_BLOCK_SIZE(1100 + 32));
+    ASSERT_LT(stats.block_bytes, 1200UL);
+    // Consecutive blocks are split from the same free block.
+    void *next = earena_alloc(a, 1100);
+    ASSERT_EQ((char *) next - (char *) ptr, (long) TLSF_BLOCK_SIZE(1100 + 32));
+    earena_free(a, ptr);
+    earena_free(a, next);
+    earena_destroy(a);
+}
+
+TEST(Tlsf, merge) {
+    // Random sizes freed in random order merge back into one block per pool.
+    EArena *a = create_tlsf_arena();
+    mt19937_64 gen(1);
+    vector<pair<char *, unsigned long>> live;
+    for (int i = 0; i < 20000; i++) {
+        if (!live.empty() && gen() % 3 == 0) {
+            auto &victim = live[gen() % live.size()];
+            ASSERT_EQ(victim.first[0], (char) victim.second);
+            ASSERT_EQ(victim.first[victim.second - 1], (char) victim.second);
+            earena_free(a, victim.first);
+            victim = live.back();
+            live.pop_back();
+        }
+        unsigned long size = SMALLALLOC + 1 + gen() % (gen() % 2 ? 2000 : LARGEALLOC - SMALLALLOC - 1);
+        char *ptr = (char *) earena_alloc(a, size);
+        ASSERT_EQ((unsigned long) ptr % 16, 0UL);
+        ptr[0] = ptr[size - 1] = (char) size;
+        live.push_back({ptr, size});
+    }
+    for (auto &p: live)
+        earena_free(a, p.first);
+    unsigned long nb_pools = 0;
+    for (TlsfPool *pool = a->tlsf_pools; pool != NULL; pool = pool->next)
+        nb_pools++;
+    ASSERT_EQ(nb_free_blocks(a), nb_pools);
+    ASSERT_EQ(earena_stats(a).live_bytes, 0UL);
+    earena_destroy(a);
+}
+
+TEST(Tlsf, resize) {
+    EArena *a = create_tlsf_arena();
+    char *ptr = (char *) earena_alloc(a, 1000);
+    memset(ptr, 7, 1000);
+    Alloc alloc = mark_check_and_get_alloc(ptr);
+    // Shrinking frees the tail, growing takes it back while it is free.
+    ASSERT_EQ(erealloc_medium(a, alloc, 200), ptr);
+    char *tail = (char *) earena_alloc(a, 100);
+    ASSERT_EQ(tail, ptr - 32 + TLSF_BLOCK_SIZE(200 + 32) + 32);
+    alloc = mark_check_and_get_alloc(ptr);
+    ASSERT_EQ(erealloc_medium(a, alloc, 1000), nullptr);
+    earena_free(a, tail);
+    ASSERT_EQ(erealloc_medium(a, alloc, 3000), ptr);
+    for (int i = 0; i < 200; i++)
+        ASSERT_EQ(ptr[i], 7);
+    ASSERT_EQ(mark_check_and_get_alloc(ptr).size, 3000UL + 32);
+    earena_free(a, ptr);
+    ASSERT_EQ(nb_free_blocks(a), 1UL);
+    earena_destroy(a);
+}
+
+TEST(Tlsf, aligned) {
+    // Only the arenas can have their own engine, the main one is set by the build.
+    if (arena.medium_engine != EM_MEDIUM_TLSF)
+        GTEST_SKIP() << "the main arena uses the buddy engine";
+    EmallocStats before = emalloc_stats();
+    vector<void *> ptrs;
+    for (unsigned long alignment = 32; alignment <= FIRST_ALLOC_MEDIUM; alignment <<= 1) {
+        for (unsigned long size: {1UL, 100UL, 1000UL, 60000UL}) {
+            void *ptr = ealigned_alloc(alignment, size);
+            ASSERT_EQ((unsigned long) ptr % alignment, 0UL) << alignment << " " << size;
+            ASSERT_GE(emalloc_usable_size(ptr), size);
+            memset(ptr, 1, size);
+            ptrs.push_back(ptr);
+        }
+    }
+    // Served by the TLSF pools, no segment is mapped for them.
+    EmallocStats during = emalloc_stats();
+    ASSERT_EQ(during.nb_alloc[LARGE_KIND], before.nb_alloc[LARGE_KIND]);
+    ASSERT_EQ(during.nb_alloc[MEDIUM_KIND] - before.nb_alloc[MEDIUM_KIND], ptrs.size());
+    for (auto p: ptrs)
+        efree(p);
+    ASSERT_EQ(emalloc_stats().live_bytes, before.live_bytes);
+}
+
+TEST(Tlsf, hugepages) {
+    // Pools are aligned on huge pages and hold at least one.
+    ASSERT_EQ(emallopt(EM_HUGEPAGES, 1), 1);
+    EArena *a = create_tlsf_arena();
+    void *ptr = earena_alloc(a, 1000);
+    ASSERT_EQ((unsigned long) a->tlsf_pools % HUGE_PAGE_SIZE, 0UL);
+    ASSERT_GE(a->tlsf_pools->size, HUGE_PAGE_SIZE);
+    earena_free(a, ptr);
+    earena_destroy(a);
+    if (arena.medium_engine == EM_MEDIUM_TLSF) {
+        // The pools of the main arena are counted, never more than they hold.
+        vector<void *> blocks;
+        for (unsigned long i = 0; i < 2 * HUGE_PAGE_SIZE / 4096; i++) {
+            blocks.push_back(emalloc(4096 - 32));
+            memset(blocks.back(), 1, 4096 - 32);
+        }
+        unsigned long pool_bytes = 0;
+        for (TlsfPool *pool = arena.tlsf_pools; pool != NULL; pool = pool->next)
+            pool_bytes += pool->size;
+        unsigned long hugepage_bytes = emalloc_hugepage_bytes();
+        ASSERT_EQ(hugepage_bytes % HUGE_PAGE_SIZE, 0UL);
+        ASSERT_LE(hugepage_bytes, pool_bytes + arena.small_region_accessible);
+        for (auto b: blocks)
+            efree(b);
+    }
+    ASSERT_EQ(emallopt(EM_HUGEPAGES, 0), 1);
+}
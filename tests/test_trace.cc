@@ -0,0 +1,170 @@
+/******************************************************
+ * Copyright Grégory Mounié 2008-2018                 *
+ * This code is distributed under the GLPv3+ licence. *
+ * Ce code est distribué sous la licence GPLv3+.      *
+ ******************************************************/
+
+#include <gtest/gtest.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <thread>
+#include <vector>
+#include <fstream>
+#include <iterator>
+#include <map>
+
+#include "../src/mem.h"
+#include "../src/mem_internals.h"
+
+using namespace std;
+
+constexpr int NB_OPS = 1000;
+
+static vector<EmallocTraceEvent> read_trace(const char *path, unsigned int *dropped = nullptr) {
+    ifstream file(path, ios::binary);
+    vector<char> content((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+    EmallocTraceHeader header;
+    EXPECT_GE(content.size(), sizeof(header));
+    memcpy(&header, content.data(), sizeof(header));
+    EXPECT_EQ(header.magic, EM_TRACE_MAGIC);
+    EXPECT_EQ(header.event_size, sizeof(EmallocTraceEvent));
+    EXPECT_EQ((content.size() - sizeof(header)) % sizeof(EmallocTraceEvent), 0UL);
+    if (dropped != nullptr)
+        *dropped = header.dropped;
+    vector<EmallocTraceEvent> events((content.size() - sizeof(header)) / sizeof(EmallocTraceEvent));
+    memcpy(events.data(), content.data() + sizeof(header), events.size() * sizeof(EmallocTraceEvent));
+    return events;
+}
+
+static void traffic() {
+    for (int i = 0; i < NB_OPS; i++) {
+        void *ptr = emalloc(1 + i * 37 % (2 * LARGEALLOC));
+        efree(ptr);
+    }
+}
+
+TEST(Trace, events) {
+    char path[] = "/tmp/emalloc_traceXXXXXX";
+    int fd = mkstemp(path);
+    ASSERT_NE(fd, -1);
+    close(fd);
+
+    ASSERT_EQ(emalloc_trace_start(path), 0);
+    ASSERT_EQ(emalloc_trace_start(path), -1);
+    thread other(traffic);
+    traffic();
+    other.join();
+    void *ptr = emalloc(100);
+    ptr = erealloc(ptr, 10000);
+    efree(ptr);
+    emalloc_trace_stop();
+    // Not traced anymore.
+    efree(emalloc(10));
+
+    unsigned int dropped = 0;
+    vector<EmallocTraceEvent> events = read_trace(path, &dropped);
+    unlink(path);
+    ASSERT_EQ(dropped, 0U);
+    ASSERT_EQ(events.size(), 4UL * NB_OPS + 3);
+    map<unsigned int, vector<EmallocTraceEvent>> threads;
+    for (auto &e: events)
+        threads[e.thread].push_back(e);
+    ASSERT_EQ(threads.size(), 2UL);
+    for (auto &t: threads) {
+        // Each thread's events are in order, an allocation is followed by its free.
+        auto &e = t.second;
+        for (int i = 0; i < NB_OPS; i++) {
+            unsigned long size = 1 + i * 37 % (2 * LARGEALLOC);
+            ASSERT_EQ(e[2 * i].op, EM_TRACE_MALLOC);
+            ASSERT_EQ(e[2 * i].size, size);
+            ASSERT_EQ(e[2 * i].kind, size <= SMALLALLOC ? SMALL_KIND : size < LARGEALLOC ? MEDIUM_KIND : LARGE_KIND);
+            ASSERT_EQ(e[2 * i + 1].op, EM_TRACE_FREE);
+            ASSERT_EQ(e[2 * i + 1].address, e[2 * i].address);
+            ASSERT_EQ(e[2 * i + 1].kind, e[2 * i].kind);
+        }
+        for (unsigned long i = 1; i < e.size(); i++)
+            ASSERT_GE(e[i].timestamp, e[i - 1].timestamp);
+    }
+    // The buffers are flushed one after the other, the last events of this thread
+    // may come before those of the other one in the file.
+    auto &mine = threads.begin()->second.size() > NB_OPS * 2 ? threads.begin()->second : threads.rbegin()->second;
+    ASSERT_EQ(mine.size(), 2UL * NB_OPS + 3);
+    auto &last = mine.back();
+    auto &realloc = mine[mine.size() - 2];
+    ASSERT_EQ(realloc.op, EM_TRACE_REALLOC);
+    ASSERT_EQ(realloc.size, 10000UL);
+    ASSERT_EQ(realloc.previous, mine[mine.size() - 3].address);
+    ASSERT_EQ(last.op, EM_TRACE_FREE);
+    ASSERT_EQ(last.address, realloc.address);
+}
+
+TEST(Trace, dropped) {
+    char path[] = "/tmp/emalloc_traceXXXXXX";
+    int fd = mkstemp(path);
+    ASSERT_NE(fd, -1);
+    close(fd);
+
+    // Faster than the flusher empties the buffer, the events that do not fit are counted.
+    constexpr unsigned long NB_BURST = 500000;
+    ASSERT_EQ(emalloc_trace_start(path), 0);
+    for (unsigned long i = 0; i < NB_BURST; i++)
+        efree(emalloc(16));
+    emalloc_trace_stop();
+    unsigned int dropped = 0;
+    vector<EmallocTraceEvent> events = read_trace(path, &dropped);
+    ASSERT_EQ(events.size() + dropped, 2 * NB_BURST);
+
+    // The count starts again with the next trace.
+    ASSERT_EQ(emalloc_trace_start(path), 0);
+    efree(emalloc(16));
+    emalloc_trace_stop();
+    events = read_trace(path, &dropped);
+    unlink(path);
+    ASSERT_EQ(events.size(), 2UL);
+    ASSERT_EQ(dropped, 0U);
+}
+
+static pthread_key_t late_key;
+
+static void late_destructor(void *) {
+    // Runs after the trace buffer of the thread is given back.
+    efree(emalloc(100));
+}
+
+TEST(Trace, threadexit) {
+    char path[] = "/tmp/emalloc_traceXXXXXX";
+    int fd = mkstemp(path);
+    ASSERT_NE(fd, -1);
+    close(fd);
+
+    ASSERT_EQ(emalloc_trace_start(path), 0);
+    // The trace key exists, this one is created after it and its destructor runs later.
+    ASSERT_EQ(pthread_key_create(&late_key, late_destructor), 0);
+    unsigned int tid = 0;
+    thread exiting([&tid]() {
+        tid = syscall(SYS_gettid);
+        pthread_setspecific(late_key, &late_key);
+        efree(emalloc(10));
+    });
+    exiting.join();
+    // A new thread takes over the buffer, the destructor events are already in the trace.
+    thread next(traffic);
+    next.join();
+    emalloc_trace_stop();
+    pthread_key_delete(late_key);
+
+    vector<EmallocTraceEvent> events = read_trace(path);
+    unlink(path);
+    vector<EmallocTraceEvent> mine;
+    for (auto &e: events)
+        if (e.thread == tid)
+            mine.push_back(e);
+    ASSERT_EQ(mine.size(), 4UL);
+    ASSERT_EQ(mine[0].size, 10UL);
+    ASSERT_EQ(mine[2].op, EM_TRACE_MALLOC);
+    ASSERT_EQ(mine[2].size, 100UL);
+    ASSERT_EQ(events.size(), 4UL + 2 * NB_OPS);
+}
+